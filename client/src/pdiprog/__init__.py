@@ -1,107 +1,1243 @@
-import serial, sys
+import argparse, binascii, serial, struct, sys, threading, time
+
+from pdiprog.compress import compress
+from pdiprog.devices import Device
+from pdiprog.image import ImageError, PageMap, read_segments
+from pdiprog.plan import BLANK, ERASE_SECTION, OTHER, SAME, Costs, plan_section
+from pdiprog.runner import discover_ports, report, run_all
+
+SECTION_APP = 1
+SECTION_BOOT = 2
+
+SECTION_NAMES = {SECTION_APP: "application", SECTION_BOOT: "boot"}
+# The same on every device. Everything else about the memories comes from
+# the programmer, for the device attached (see pdiprog.devices).
+EEPROM_PAGE_SIZE = 32
+FUSE_COUNT = 6
+# Stands for the lock bits among fuse numbers.
+LOCK_BITS = "lock bits"
+
+# Where avr-gcc puts each memory in HEX and ELF files. Flash is at 0, with the
+# boot section straight after the application section.
+EEPROM_OFFSET = 0x810000
+FUSE_OFFSET = 0x820000
+LOCK_OFFSET = 0x830000
+SIGNATURE_OFFSET = 0x840000
+USER_SIG_OFFSET = 0x850000
+
+DEFAULT_BAUD = 57600
+# Candidate rates for SET_BAUD, fastest first. The programmer refuses any it
+# cannot generate accurately from its clock.
+BAUD_RATES = [1500000, 1000000, 750000, 500000, 460800, 250000, 230400, 115200]
+# Seconds the programmer waits for a handshake after switching rate
+# (Client::BAUD_HANDSHAKE_TIMEOUT_MS).
+BAUD_HANDSHAKE_TIMEOUT = 1.0
 
 class PDIProgrammerError(Exception):
   pass
 
+# What the programmer's response codes mean, for those that report a failure.
+RESPONSE_ERRORS = {
+  0x01: "invalid request",
+  0x02: "CRC mismatch",
+  0x03: "invalid argument",
+  0x04: "invalid compressed stream",
+  0x10: "PDI serial error",
+  0x11: "PDI timeout",
+  0x12: "invalid length",
+  0x13: "invalid section",
+  0x14: "target state differs from programmer's record",
+  0x15: "unsupported device",
+  0x16: "targets are different devices",
+  0x17: "lock bits are programmed, and only a chip erase clears them",
+  0xFE: "internal error",
+  0xFF: "unknown error",
+}
+
+# Failed flash writes give the address of the first page that failed, or this.
+NO_FAILURE = 0xFFFFFFFF
+
+class ResponseError(PDIProgrammerError):
+  """A request failed. `addr` is where, for flash writes."""
+
+  def __init__(self, code, addr=None):
+    self.code = code
+    self.addr = addr
+    msg = RESPONSE_ERRORS.get(code, "response %02Xh" % code)
+    if addr is not None:
+      msg += " at %06Xh" % addr
+    PDIProgrammerError.__init__(self, msg)
+
+class Output(object):
+  """Where a job's messages go: `log` for its steps, `progress` for the
+  page-by-page detail within them."""
+
+  def log(self, msg):
+    print msg
+
+  def progress(self, msg):
+    print msg
+
+class TargetOutput(Output):
+  """Output for one target of a panel, passed on to `out`."""
+
+  def __init__(self, target, out):
+    self.target = target
+    self.out = out
+
+  def log(self, msg):
+    self.out.log("Target %d: %s" % (self.target, msg))
+
+  def progress(self, msg):
+    self.out.progress("Target %d: %s" % (self.target, msg))
+
+# Names of the programmer's performance counters and timed phases, in the order
+# of Stats::Counter and Stats::Phase.
+STATS_COUNTERS = ["bytes_sent", "bytes_received", "direction_switches",
+                  "timeouts", "serial_errors", "nvm_waits", "busy_polls",
+                  "retries", "erases_avoided",
+                  "compressed_bytes", "decompressed_bytes"]
+STATS_PHASES = ["attach", "chip_erase", "section_erase", "page_load",
+                "page_commit", "fuse_write"]
+
+class Stats(object):
+  """Counters and phase timings from the programmer. Phases are (completions,
+  total seconds, longest seconds)."""
+
+  def __init__(self, counters, phases):
+    self.counters = counters
+    self.phases = phases
+
+  def format(self):
+    c = self.counters
+    lines = [
+      "PDI link: %d bytes sent, %d received, %d direction switches, %d timeouts, %d serial errors" %
+        (c["bytes_sent"], c["bytes_received"], c["direction_switches"], c["timeouts"], c["serial_errors"]),
+      "NVM controller: waited %d times, %d status polls, %d reads and page writes retried, %d erases left out" %
+        (c["nvm_waits"], c["busy_polls"], c["retries"], c["erases_avoided"]),
+      "%-14s %6s %10s %10s %10s" % ("phase", "count", "total ms", "mean ms", "max ms"),
+    ]
+    for name in STATS_PHASES:
+      count, total, longest = self.phases[name]
+      if count:
+        lines.append("%-14s %6d %10.1f %10.2f %10.2f" %
+          (name, count, total * 1e3, total * 1e3 / count, longest * 1e3))
+    return "\n".join(lines)
+
+def crc24(data, size):
+  """CRC of `data` padded with erased bytes to `size` bytes, as computed by the
+  target's APPCRC and BOOTCRC commands."""
+  data = bytearray(data) + bytearray("\xff" * (size - len(data)))
+  crc = 0
+  for i in range(0, len(data), 2):
+    crc <<= 1
+    if crc & 0x1000000:
+      crc ^= 0x80001B
+    crc = (crc ^ data[i] ^ (data[i + 1] << 8)) & 0xFFFFFF
+  return crc
+
+class Link(object):
+  """Block-framed, windowed link to the programmer (see src/Client.hpp)."""
+
+  BLOCK_SIZE = 64
+  WINDOW_SIZE = 4
+
+  DATA = 0xD0
+  ACK = 0xA0
+  NAK = 0xB0
+  SYNC = 0x59
+  SYNC_REPLY = 0xA6
+  SYNC_LEN = 4
+
+  # Seconds to wait for an ACK before retransmitting a frame.
+  RETRANSMIT_TIMEOUT = 0.25
+
+  def __init__(self, ser):
+    self.ser = ser
+    # Total bytes written to the serial port.
+    self.bytes_sent = 0
+    self._reset_state()
+
+  def _write(self, data):
+    self.ser.write(data)
+    self.bytes_sent += len(data)
+
+  def _reset_state(self):
+    self.tx_seq = 0
+    self.tx_queue = []
+    self.outstanding = {}
+    self.peer_base = 0
+    self.rx_seq = 0
+    self.rx_raw = bytearray()
+    self.rx_data = bytearray()
+
+  def sync(self, timeout):
+    """Reset the link. Returns True if the programmer replied."""
+    self.ser.reset_input_buffer()
+    self._write(chr(self.SYNC) * self.SYNC_LEN)
+    self._reset_state()
+    deadline = time.time() + timeout
+    while time.time() < deadline:
+      byte = self.ser.read(1)
+      if len(byte) and ord(byte) == self.SYNC_REPLY:
+        return True
+    return False
+
+  @staticmethod
+  def _crc(seq, payload):
+    return binascii.crc_hqx(str(bytearray([seq, len(payload)]) + payload), 0xFFFF)
+
+  def _frame(self, seq):
+    payload = self.outstanding[seq][0]
+    self.outstanding[seq][1] = time.time()
+    frame = bytearray([self.DATA, seq, len(payload)]) + payload
+    return frame + bytearray(struct.pack("<H", self._crc(seq, payload)))
+
+  def _transmit(self, seq):
+    self._write(str(self._frame(seq)))
+
+  def _window_open(self):
+    return ((self.tx_seq - self.peer_base) & 0xFF) < self.WINDOW_SIZE
+
+  def _pump(self):
+    """Transmit whatever the window allows and process incoming frames."""
+    out = bytearray()
+    while self.tx_queue and self._window_open():
+      seq = self.tx_seq
+      self.tx_seq = (self.tx_seq + 1) & 0xFF
+      self.outstanding[seq] = [self.tx_queue.pop(0), 0]
+      out += self._frame(seq)
+    if out:
+      self._write(str(out))
+
+    now = time.time()
+    for seq, entry in self.outstanding.items():
+      if now - entry[1] > self.RETRANSMIT_TIMEOUT:
+        self._transmit(seq)
+
+    n = max(1, self.ser.in_waiting)
+    chunk = self.ser.read(n)
+    if len(chunk) == 0:
+      return False
+    self.rx_raw += bytearray(chunk)
+    self._parse()
+    return True
+
+  def _parse(self):
+    raw = self.rx_raw
+    while raw:
+      kind = raw[0]
+      if kind in (self.ACK, self.NAK):
+        if len(raw) < 4:
+          break
+        seq, base, check = raw[1], raw[2], raw[3]
+        if check != (~(seq ^ base) & 0xFF):
+          del raw[0]
+          continue
+        del raw[:4]
+        if ((self.tx_seq - base) & 0xFF) <= self.WINDOW_SIZE:
+          self.peer_base = base
+        if seq in self.outstanding:
+          if kind == self.ACK:
+            del self.outstanding[seq]
+          else:
+            self._transmit(seq)
+      elif kind == self.DATA:
+        if len(raw) < 3:
+          break
+        seq, length = raw[1], raw[2]
+        if len(raw) < length + 5:
+          break
+        payload = raw[3:3 + length]
+        crc, = struct.unpack("<H", str(raw[3 + length:5 + length]))
+        if crc != self._crc(seq, payload) or seq != self.rx_seq:
+          raise PDIProgrammerError("corrupted response from programmer")
+        del raw[:length + 5]
+        self.rx_seq = (self.rx_seq + 1) & 0xFF
+        self.rx_data += payload
+      else:
+        # Stray byte (e.g. a late SYNC_REPLY); skip it.
+        del raw[0]
+
+  def _wait_for(self, done, timeout):
+    last_progress = time.time()
+    while not done():
+      if self._pump():
+        last_progress = time.time()
+      elif time.time() - last_progress > timeout:
+        raise PDIProgrammerError("timed out while waiting for programmer")
+
+  def send(self, data, timeout=2.0):
+    """Queue `data` for transmission. Returns once every frame has been sent at
+    least once; delivery is confirmed by later calls."""
+    data = bytearray(data)
+    for i in range(0, len(data), self.BLOCK_SIZE):
+      self.tx_queue.append(data[i:i + self.BLOCK_SIZE])
+    self._wait_for(lambda: not self.tx_queue, timeout)
+
+  def recv(self, n, timeout=2.0):
+    self._wait_for(lambda: len(self.rx_data) >= n, timeout)
+    data = self.rx_data[:n]
+    del self.rx_data[:n]
+    return data
+
+def page_digest(page):
+  """CRC16 of a page, as returned by PDIProgrammer.page_digests."""
+  return binascii.crc_hqx(str(page), 0xFFFF)
+
+def section_size(device, section):
+  return device.app_size if section == SECTION_APP else device.boot_size
+
 class PDIProgrammer(object):
   def __init__(self, ser):
     self.ser = ser
+    self.link = Link(ser)
+    self.pending = []
+    # Pages the programmer found to be blank and did not program.
+    self.pages_skipped = 0
+    # Flash data sent, before any compression.
+    self.flash_bytes = 0
+    # Targets that have failed a WRITE_FLASH_TARGETS request.
+    self.failed_targets = set()
+    # The selected target, as found by attach().
+    self.device = None
 
-  def _send(self, byte):
-    self.ser.write(chr(byte & 0xFF))
-    ack = self.ser.read(1)
-    if len(ack) == 0:
-      raise PDIProgrammerError("timed out while waiting for acknowledgement")
+  def _send(self, data):
+    self.link.send(data)
 
-  def _recv(self):
-    resp = self.ser.read(1)
-    if len(resp) == 0:
-      raise PDIProgrammerError("timed out while waiting for acknowledgement")
-    return ord(resp)
+  def _recv(self, n=1):
+    return self.link.recv(n)
 
-  def sync(self):
-    old_timeout = self.ser.timeout
-    self.ser.timeout = 0.05
-    ok = False
-    for i in range(40):
+  def _expect(self, expect=0x00, extra=0, handler=None, failed_addr=False):
+    """Queue a check of the response to the request just sent. Requests can be
+    pipelined; call wait() to collect their responses. `extra` bytes of
+    response data following the code are passed to `handler`. With
+    `failed_addr`, the last 4 of them are the address of any failure."""
+    self.pending.append((expect, extra, handler, failed_addr))
+
+  def wait(self):
+    """Collect the responses to pipelined requests, and raise a ResponseError
+    for the first that failed once they have all arrived."""
+    pending, self.pending = self.pending, []
+    error = None
+    for expect, extra, handler, failed_addr in pending:
+      resp = self._recv()[0]
+      data = self._recv(extra) if extra else None
+      if handler is not None:
+        handler(data)
+      if resp != expect and error is None:
+        addr = struct.unpack("<I", str(data[-4:]))[0] if failed_addr else None
+        error = ResponseError(resp, addr if addr != NO_FAILURE else None)
+    if error is not None:
+      raise error
+
+  def _check_response(self, expect=0x00):
+    self._expect(expect)
+    self.wait()
+
+  def _try_sync(self, attempts):
+    for i in range(attempts):
+      if not self.link.sync(0.05):
+        continue
       try:
-        self._send(0x59)
+        self._send(chr(0x59))
         self._check_response(0xA6)
-        ok = True
-        break
+        return True
       except PDIProgrammerError:
-        # Blash it with NULLs since it's probably waiting for input from us.
-        self.ser.write("\x00" * 32)
-        self.ser.read(1024)
-    self.ser.timeout = old_timeout
-    if not ok:
+        self.pending = []
+    return False
+
+  def sync(self):
+    if self._try_sync(40):
+      return
+    # A client that did not shut down cleanly may have left the programmer at
+    # a negotiated rate. Find it and send END, which restores the default.
+    rate = self.ser.baudrate
+    for other in BAUD_RATES:
+      self.ser.baudrate = other
+      if self._try_sync(3):
+        self.close()
+        break
+    self.ser.baudrate = rate
+    if not self._try_sync(40):
       raise PDIProgrammerError("failed to synchronise with programmer")
 
-  def _check_response(self, expect=0x00):
-    resp = self._recv()
-    if resp != expect:
-      raise PDIProgrammerError(hex(resp))
+  def set_baud(self, rate):
+    """Move both ends of the link to `rate`. Returns False, with the link
+    still running at the old rate, if this is not possible."""
+    self.wait()
+    self._send(struct.pack("<BI", 0x08, rate))
+    resp = self._recv()[0]
+    if resp == 0x03:
+      return False
+    if resp != 0x00:
+      raise ResponseError(resp)
+
+    old_rate = self.ser.baudrate
+    try:
+      self.ser.baudrate = rate
+      time.sleep(0.01)
+      # The programmer keeps the new rate once it has seen one reset, so later
+      # ones, if its reply was lost, find it still there.
+      for i in range(5):
+        if self.link.sync(0.1):
+          return True
+    except (ValueError, serial.SerialException):
+      pass
+
+    # Fall back once the programmer has given up waiting for us.
+    self.ser.baudrate = old_rate
+    time.sleep(BAUD_HANDSHAKE_TIMEOUT + 0.1)
+    self.sync()
+    return False
+
+  def negotiate_baud(self, max_rate):
+    """Switch to the fastest rate in BAUD_RATES up to `max_rate` that works.
+    Returns the rate in use."""
+    for rate in BAUD_RATES:
+      if rate <= max_rate and rate > self.ser.baudrate and self.set_baud(rate):
+        return rate
+    return self.ser.baudrate
+
+  def attach(self):
+    """Attach to the target, and set `device` to what it turns out to be.
+    Returns the PDI clock rate and guard time the programmer settled on."""
+    self.wait()
+    self._send(chr(0x09))
+    self._check_response()
+    clock, guard_time, sig0, sig1, sig2, page_size, app_pages, boot_pages, eeprom_size = \
+      struct.unpack("<IB3BHHHH", str(self._recv(16)))
+    self.device = Device((sig0 << 16) | (sig1 << 8) | sig2, page_size, app_pages, boot_pages, eeprom_size)
+    return clock, guard_time
+
+  def stats(self, reset=False):
+    """Returns the programmer's performance counters and phase timers as a
+    Stats, then resets them if `reset` is set."""
+    self.wait()
+    self._send(struct.pack("<BB", 0x10, 0x01 if reset else 0x00))
+    self._check_response()
+    tick_hz, n = struct.unpack("<IB", str(self._recv(5)))
+    values = struct.unpack("<%dI" % n, str(self._recv(4 * n)))
+    counters = dict((name, 0) for name in STATS_COUNTERS)
+    counters.update(zip(STATS_COUNTERS, values))
+    n = self._recv()[0]
+    phases = {}
+    for name in STATS_PHASES[:n]:
+      count, total, longest = struct.unpack("<III", str(self._recv(12)))
+      phases[name] = (count, float(total) / tick_hz, float(longest) / tick_hz)
+    # Anything this client does not know about.
+    self._recv(12 * (n - len(phases)))
+    for name in STATS_PHASES[n:]:
+      phases[name] = (0, 0.0, 0.0)
+    return Stats(counters, phases)
+
+  def select_target(self, target):
+    """Direct later requests to `target`, on programmers with several PDI
+    channels. Returns the number of targets the programmer has."""
+    self.wait()
+    self._send(struct.pack("<BB", 0x11, target))
+    resp = self._recv()[0]
+    count = self._recv()[0]
+    if resp == 0x03:
+      raise PDIProgrammerError("programmer has no target %d (it has %d)" % (target, count))
+    if resp != 0x00:
+      raise ResponseError(resp)
+    return count
 
   def erase_chip(self):
-    self._send(0x01)
+    self._send(chr(0x01))
+    self._check_response()
+
+  def erase_section(self, section):
+    """Erase a flash section, unless the programmer knows it to be erased
+    already."""
+    self._send(struct.pack("<BB", 0x14, section))
     self._check_response()
 
   def write_app_flash(self, addr, buf):
-    self._send(0x02)
-    self._send(addr & 0xFF)
-    self._send((addr >> 8) & 0xFF)
-    self._send((addr >> 16) & 0xFF)
-    self._send((addr >> 24) & 0xFF)
-    self._send(len(buf) & 0xFF)
-    self._send((len(buf) >> 8) & 0xFF)
-    for byte in buf:
-      if isinstance(byte, str):
-        byte = ord(byte)
-      self._send(byte)
+    """Send a WRITE_APP_FLASH request without waiting for its response."""
+    self._send(struct.pack("<BIH", 0x02, addr, len(buf)) + bytes(buf))
+    self._expect(extra=6, handler=self._count_skipped, failed_addr=True)
+
+  def erase_write_app_flash(self, addr, buf):
+    """Like write_app_flash, but erases each page as it is written."""
+    self._send(struct.pack("<BIH", 0x07, addr, len(buf)) + bytes(buf))
+    self._expect(extra=6, handler=self._count_skipped, failed_addr=True)
+
+  def write_flash(self, section, addr, buf, pre_erase=False, targets=None):
+    """Send a WRITE_FLASH request for `section` without waiting for its
+    response. If `targets` is given, the programmer writes the data to each of
+    them, and any that fail are added to `failed_targets`."""
+    flags = 0x01 if pre_erase else 0x00
+    self.flash_bytes += len(buf)
+    if targets is None:
+      self._send(struct.pack("<BBBIH", 0x0E, section, flags, addr, len(buf)) + bytes(buf))
+      self._expect(extra=6, handler=self._count_skipped, failed_addr=True)
+    else:
+      mask = sum(1 << target for target in targets)
+      self._send(struct.pack("<BBBBIH", 0x12, section, flags, mask, addr, len(buf)) + bytes(buf))
+      self._expect(extra=7, handler=self._count_failed, failed_addr=True)
+
+  def write_flash_compressed(self, section, addr, buf, stream, pre_erase=False, targets=None):
+    """Like write_flash, but sending `stream`, the compressed form of `buf`."""
+    flags = 0x01 if pre_erase else 0x00
+    mask = sum(1 << target for target in targets) if targets is not None else 0
+    self.flash_bytes += len(buf)
+    self._send(struct.pack("<BBBBIHH", 0x13, section, flags, mask, addr, len(buf), len(stream)) + bytes(stream))
+    self._expect(extra=7, handler=self._count_failed, failed_addr=True)
+
+  def page_digests(self, section, first_page, count):
+    """Returns the page_digest of each of `count` pages of `section`, as
+    currently programmed into the target. If a page cannot be read, the
+    ResponseError raised has the `digests` of the pages before it."""
+    self.wait()
+    self._send(struct.pack("<BBHH", 0x06, section, first_page, count))
     self._check_response()
+    digests = struct.unpack("<%dH" % count, str(self._recv(2 * count)))
+    resp, failed_addr = struct.unpack("<BI", str(self._recv(5)))
+    if resp != 0x00:
+      error = ResponseError(resp, failed_addr)
+      # The target may not even have been identified.
+      failed_page = failed_addr / self.device.page_size if self.device.page_size else 0
+      error.digests = digests[:max(failed_page - first_page, 0)]
+      raise error
+    return digests
+
+  def _count_skipped(self, data):
+    self.pages_skipped += struct.unpack("<H", str(data[:2]))[0]
+
+  def _count_failed(self, data):
+    self.failed_targets.update(t for t in range(8) if data[0] & (1 << t))
+    self.pages_skipped += struct.unpack("<H", str(data[1:3]))[0]
+
+  def verify_crc(self, section):
+    """Returns the CRC of `section` computed by the target, and the CRC the
+    programmer expects given what it has written (None if unknown)."""
+    self.wait()
+    self._send(struct.pack("<BB", 0x04, section))
+    resp = self._recv()[0]
+    if resp not in (0x00, 0x02):
+      raise ResponseError(resp)
+    actual, expected, known = struct.unpack("<IIB", str(self._recv(9)))
+    return actual, (expected if known else None)
+
+  def read_memory(self, addr, length, f):
+    """Read `length` bytes from PDI address `addr` into the file `f`. Returns
+    the number of bytes that arrived as erased runs rather than literally."""
+    self.wait()
+    self._send(struct.pack("<BII", 0x05, addr, length))
+    self._check_response()
+    elided = 0
+    while True:
+      tag = self._recv()[0]
+      if tag == 0x00:
+        n, = struct.unpack("<H", str(self._recv(2)))
+        f.write(str(self._recv(n)))
+      elif tag == 0x01:
+        n, = struct.unpack("<I", str(self._recv(4)))
+        f.write("\xff" * n)
+        elided += n
+      elif tag == 0x02:
+        resp = self._recv()[0]
+        if resp != 0x00:
+          raise ResponseError(resp)
+        return elided
+      else:
+        raise PDIProgrammerError("bad read record %02X" % tag)
+
+  def write_eeprom(self, addr, data):
+    """Write `data` to the EEPROM at offset `addr`. Returns the number of pages
+    that already held the data and were left alone."""
+    self.wait()
+    self._send(struct.pack("<BHH", 0x0B, addr, len(data)) + bytes(data))
+    resp = self._recv()[0]
+    unchanged = self._recv()[0]
+    if resp != 0x00:
+      raise ResponseError(resp)
+    return unchanged
+
+  def read_eeprom(self, addr, length):
+    self.wait()
+    self._send(struct.pack("<BHH", 0x0C, addr, length))
+    self._check_response()
+    data = str(self._recv(length))
+    resp = self._recv()[0]
+    if resp != 0x00:
+      raise ResponseError(resp)
+    return data
+
+  def erase_eeprom(self, addr=0, length=None):
+    """Erase `length` bytes of the EEPROM from `addr`, or all of it."""
+    if length is None:
+      length = self.device.eeprom_size
+    self.wait()
+    self._send(struct.pack("<BHH", 0x0D, addr, length))
+    self._check_response()
+
+  def write_user_sig(self, data):
+    """Erase the user signature row and write `data` to the start of it."""
+    self._send(struct.pack("<BH", 0x0F, len(data)) + bytes(data))
+    self._expect()
 
   def write_fuse(self, addr, data):
-    self._send(0x03)
-    self._send(addr)
-    self._send(data)
+    self._send(struct.pack("<BBB", 0x03, addr, data))
     self._check_response()
 
+  def write_fuses(self, fuses, lock=None):
+    """Write the fuse bytes in `fuses` (fuse number -> value), and then the
+    lock bits if `lock` is given, in one request. The programmer leaves out
+    those that already hold their values. Returns the set of fuse numbers
+    (and LOCK_BITS) written, and what each held before."""
+    keys = sorted(fuses) + ([LOCK_BITS] if lock is not None else [])
+    values = [fuses[fuse] for fuse in sorted(fuses)] + ([lock] if lock is not None else [])
+    bits = dict((key, 0x80 if key == LOCK_BITS else 1 << key) for key in keys)
+    self.wait()
+    self._send(struct.pack("<BB", 0x15, sum(bits.values())) + str(bytearray(values)))
+    resp, written = self._recv(2)
+    previous = dict(zip(keys, self._recv(len(keys))))
+    if resp != 0x00:
+      raise ResponseError(resp)
+    return set(key for key in keys if written & bits[key]), previous
+
   def close(self):
-    self._send(0xFF)
+    self._send(chr(0xFF))
     self._check_response()
 
-def main():
-  filename = sys.argv[1]
-  with open(filename, "rb") as f:
-    program = f.read()
-  ser = serial.Serial("/dev/ttyUSB0", 57600, timeout=1)
+# Fuse values written after programming an application image, unless
+# overridden. Fuses that already hold them are left alone.
+DEFAULT_FUSES = {1: 0xff, 2: 0xff, 4: 0xff, 5: 0xff}
+
+class Regions(object):
+  """Everything to be programmed in one session, laid out for `device`."""
+  def __init__(self, device):
+    self.device = device
+    # Section -> PageMap, with addresses from the start of the section.
+    self.flash = {}
+    self.user_sig = None
+    self.eeprom = None
+    # Fuse number -> value.
+    self.fuses = {}
+    self.lock = None
+
+  def flash_map(self, section):
+    if section not in self.flash:
+      self.flash[section] = PageMap(self.device.page_size, section_size(self.device, section))
+    return self.flash[section]
+
+  def user_sig_map(self):
+    if self.user_sig is None:
+      self.user_sig = PageMap(self.device.user_sig_size, self.device.user_sig_size)
+    return self.user_sig
+
+  def eeprom_map(self):
+    if self.eeprom is None:
+      self.eeprom = PageMap(EEPROM_PAGE_SIZE, self.device.eeprom_size)
+    return self.eeprom
+
+  def image_bytes(self):
+    maps = self.flash.values() + [self.user_sig, self.eeprom]
+    return sum(pm.image_bytes for pm in maps if pm is not None) + len(self.fuses) + (self.lock is not None)
+
+  def prepare(self, sparse=True, compressed=True):
+    """Do the work that every job would otherwise repeat. The regions must
+    not change afterwards."""
+    self.crcs = dict((section, crc24(pm.flat(), section_size(self.device, section)))
+                     for section, pm in self.flash.items())
+    self.compressed = compressed
+    self.writes = dict((section, flash_writes(pm, sparse, compressed))
+                       for section, pm in self.flash.items())
+    self.page_sizes = dict((section, page_sizes(pm, self.writes[section][0], section_size(self.device, section)))
+                           for section, pm in self.flash.items())
+
+  def section_crc(self, section):
+    return self.crcs[section]
+
+def add_segment(regions, addr, data):
+  """Route a segment of a HEX or ELF image to the region it belongs to."""
+  data = bytearray(data)
+  app_size, boot_size = regions.device.app_size, regions.device.boot_size
+  if addr < app_size:
+    n = min(len(data), app_size - addr)
+    regions.flash_map(SECTION_APP).write(addr, data[:n])
+    addr, data = addr + n, data[n:]
+  if not data:
+    return
+  if addr < app_size + boot_size:
+    regions.flash_map(SECTION_BOOT).write(addr - app_size, data)
+  elif EEPROM_OFFSET <= addr < FUSE_OFFSET:
+    regions.eeprom_map().write(addr - EEPROM_OFFSET, data)
+  elif FUSE_OFFSET <= addr < LOCK_OFFSET:
+    for i, value in enumerate(data):
+      regions.fuses[addr - FUSE_OFFSET + i] = value
+  elif LOCK_OFFSET <= addr < SIGNATURE_OFFSET:
+    if addr != LOCK_OFFSET or len(data) != 1:
+      raise ImageError("lock bits at %06Xh (%d bytes), not one byte at %06Xh" % (addr, len(data), LOCK_OFFSET))
+    regions.lock = data[0]
+  elif SIGNATURE_OFFSET <= addr < USER_SIG_OFFSET:
+    # The device signature the image was built for; nothing to program.
+    pass
+  elif USER_SIG_OFFSET <= addr < USER_SIG_OFFSET + 0x10000:
+    regions.user_sig_map().write(addr - USER_SIG_OFFSET, data)
+  else:
+    raise ImageError("image has data at %06Xh, outside any known memory" % addr)
+
+def read_region(path):
+  """The (address, data) segments of a HEX, ELF or raw binary file, a raw
+  binary being a single segment at 0."""
+  segments = read_segments(path)
+  if segments is None:
+    with open(path, "rb") as f:
+      segments = [(0, f.read())]
+  return segments
+
+def load_region(pm, segments, offset):
+  """Write the segments of a file read by read_region() into `pm`. Addresses
+  may be relative to the region or, if at least `offset`, absolute."""
+  for addr, data in segments:
+    pm.write(addr - offset if addr >= offset else addr, data)
+
+class Image(object):
+  """What is to be programmed, as read from the files given. Where it goes
+  depends on the sizes of the target's memories, so regions() lays it out
+  for each device it is programmed into."""
+
+  def __init__(self):
+    # Functions that each add a file's contents to a Regions.
+    self.loads = []
+    # Fuse number -> value, and the lock bits if any. Images can give these
+    # too.
+    self.fuses = {}
+    self.lock = None
+    self.sparse = True
+    self.compressed = True
+    self._regions = {}
+    self._lock = threading.Lock()
+
+  def regions(self, device):
+    """The prepared Regions for `device`. Jobs share them, so they are only
+    laid out once for each layout of memories."""
+    if self.loads and not device.known:
+      raise PDIProgrammerError("the programmer does not support the %s" % device)
+    with self._lock:
+      if device.layout not in self._regions:
+        regions = Regions(device)
+        try:
+          for load in self.loads:
+            load(regions)
+        except ImageError as e:
+          raise PDIProgrammerError("image does not fit the %s: %s" % (device, e))
+        regions.fuses.update(self.fuses)
+        if self.lock is not None:
+          regions.lock = self.lock
+        regions.prepare(self.sparse, self.compressed)
+        self._regions[device.layout] = regions
+      return self._regions[device.layout]
+
+# Most flash data to send in one compressed request. Longer runs compress
+# better, as the programmer's window starts out blank for each request.
+COMPRESSED_RUN = 4096
+
+def compress_if_smaller(data):
+  """`data` compressed, or None if that does not make it any smaller."""
+  stream = compress(data)
+  return stream if len(stream) < len(data) else None
+
+def flash_writes(pm, sparse, compressed):
+  """Plan the requests that write the populated pages of `pm` to a freshly
+  erased flash section. Returns a list of (address, data, stream), where
+  `stream` is the compressed form of `data` or None to send it as it is, and
+  the number of blank pages that need not be sent. With `compressed`, runs
+  of consecutive pages go in one request."""
+  writes = []
+  skipped = 0
+  run_addr, run = None, ""
+
+  def end_run():
+    if run:
+      writes.append((run_addr, run, compress_if_smaller(run) if compressed else None))
+
+  for addr, chunk in pm.items():
+    if sparse and chunk.count("\xff") == len(chunk):
+      # The chip has just been erased, so there is nothing to do.
+      skipped += 1
+      continue
+    if not compressed or run_addr is None or addr != run_addr + len(run) or len(run) >= COMPRESSED_RUN:
+      end_run()
+      run_addr, run = addr, ""
+    run += chunk
+  end_run()
+  return writes, skipped
+
+def page_sizes(pm, writes, size):
+  """Bytes to send for each page of a `size`-byte section holding `pm`, 0 for
+  a blank page, going by how well `writes` compressed."""
+  raw = sum(len(data) for addr, data, stream in writes)
+  sent = sum(len(data if stream is None else stream) for addr, data, stream in writes)
+  ratio = float(sent) / raw if raw else 1.0
+  sizes = []
+  for addr in range(0, size, pm.page_size):
+    chunk = pm.page(addr)
+    sizes.append(0 if chunk.count("\xff") == len(chunk) else int(len(chunk) * ratio))
+  return sizes
+
+def send_flash(pdi, section, addr, data, stream, pre_erase=False, targets=None):
+  """Write `data` to `section`, as `stream` if it has been compressed."""
+  if stream is None:
+    pdi.write_flash(section, addr, data, pre_erase, targets)
+  else:
+    pdi.write_flash_compressed(section, addr, data, stream, pre_erase, targets)
+
+def write_section(pdi, section, regions, out, targets=None):
+  """Write `section` of `regions` to a freshly erased flash section, of
+  `targets` if given. Returns the number of blank pages that did not need
+  sending."""
+  writes, host_skipped = regions.writes[section]
+  total = sum(len(data) for addr, data, stream in writes)
+  done = 0
+  for addr, data, stream in writes:
+    size = "%d bytes" % len(data) if stream is None else "%d bytes (%d compressed)" % (len(data), len(stream))
+    out.progress("Writing %s at %s section address %06Xh (%d%% complete)" % (size, SECTION_NAMES[section], addr, done * 100 / total))
+    send_flash(pdi, section, addr, data, stream, targets=targets)
+    done += len(data)
+  pdi.wait()
+  return host_skipped
+
+def report_flash_rate(pdi, flash_bytes, seconds, out):
+  """Log how far the programmer found the flash data to be compressed, and
+  the rate it was written at."""
+  counters = pdi.stats().counters
+  if counters["decompressed_bytes"]:
+    out.log("Compressed flash data to %d%% (%d bytes for %d)." % (
+      counters["compressed_bytes"] * 100 / counters["decompressed_bytes"],
+      counters["compressed_bytes"], counters["decompressed_bytes"]))
+  if seconds:
+    out.log("Wrote %d bytes of flash in %.1f s (%.1f kB/s)." % (flash_bytes, seconds, flash_bytes / seconds / 1000))
+
+def rewrite_pages(pdi, section, regions, pages, out, targets=None):
+  """Erase and write each of `pages` (indices) of `section`, of `targets` if
+  given. The programmer only erases a page the image leaves blank, and only
+  writes one it knows to be erased."""
+  pm = regions.flash[section]
+  for page in pages:
+    addr = page * pm.page_size
+    chunk = pm.page(addr)
+    out.progress("Rewriting page at address %06Xh" % addr)
+    send_flash(pdi, section, addr, chunk, compress_if_smaller(chunk) if regions.compressed else None, pre_erase=True, targets=targets)
+  pdi.wait()
+
+def write_incremental(pdi, section, regions, out, first_page=0):
+  """Rewrite only the pages of `section`, from `first_page` on, whose contents
+  differ from `regions`."""
+  pm = regions.flash[section]
+  num_pages = pm.size / pm.page_size - first_page
+  out.log("Reading %s section page digests..." % SECTION_NAMES[section])
+  try:
+    digests = pdi.page_digests(section, first_page, num_pages)
+    error = None
+  except ResponseError as e:
+    # Deal with the pages that could be read before giving up.
+    digests, error = e.digests, e
+  differing = [first_page + i for i, digest in enumerate(digests)
+               if page_digest(pm.page((first_page + i) * pm.page_size)) != digest]
+  rewrite_pages(pdi, section, regions, differing, out)
+  if error is not None:
+    raise error
+  out.log("Rewrote %d of %d pages." % (len(differing), num_pages))
+
+# Times to pick up again after a failed flash write, or to repair a section
+# that fails verification, before giving up.
+RESUME_ATTEMPTS = 3
+
+def rewrite_differing(pdi, section, regions, out, first_page=0):
+  """write_incremental(), carrying on from wherever it fails. Gives up after
+  RESUME_ATTEMPTS failures in a row at the same page."""
+  page_size = regions.device.page_size
+  attempts = 0
+  while True:
+    try:
+      write_incremental(pdi, section, regions, out, first_page)
+      return
+    except ResponseError as e:
+      if e.addr is not None and e.addr / page_size > first_page:
+        first_page = e.addr / page_size
+        attempts = 0
+      attempts += 1
+      if attempts > RESUME_ATTEMPTS:
+        raise
+      out.log("Rewriting failed: %s. Resuming from %s section address %06Xh..." % (e, SECTION_NAMES[section], first_page * page_size))
+
+def plan_writing(pdi, section, regions, check, out):
+  """Work out whether to erase `section` or rewrite just some of its pages.
+  With `check`, what the target already holds is found from its page digests;
+  otherwise nothing is known of it."""
+  pm = regions.flash[section]
+  num_pages = pm.size / pm.page_size
+  digests = []
+  if check:
+    out.log("Reading %s section page digests..." % SECTION_NAMES[section])
+    try:
+      digests = pdi.page_digests(section, 0, num_pages)
+    except ResponseError as e:
+      # Take the pages that could not be read to hold anything.
+      digests = e.digests
+      out.log("Reading page digests failed: %s." % e)
+  blank_digest = page_digest("\xff" * pm.page_size)
+  states = [OTHER] * num_pages
+  for i, digest in enumerate(digests):
+    if digest == page_digest(pm.page(i * pm.page_size)):
+      states[i] = SAME
+    elif digest == blank_digest:
+      states[i] = BLANK
+  plan = plan_section(states, regions.page_sizes[section], Costs(pdi.ser.baudrate))
+  if plan.strategy == ERASE_SECTION:
+    out.log("Erasing and writing %s section (about %.2f s)..." % (SECTION_NAMES[section], plan.cost))
+  else:
+    out.log("Rewriting %d of %d %s section pages (about %.2f s)..." % (len(plan.pages), num_pages, SECTION_NAMES[section], plan.cost))
+  return plan
+
+def write_planned(pdi, section, regions, plan, out):
+  """Carry out the `plan` for `section`. If a write fails, carry on from the
+  page that failed: the pages from there on are checked against their
+  digests and only those that do not hold what they should are rewritten.
+  Returns the number of blank pages that did not need sending."""
+  try:
+    if plan.strategy == ERASE_SECTION:
+      pdi.erase_section(section)
+      return write_section(pdi, section, regions, out)
+    rewrite_pages(pdi, section, regions, plan.pages, out)
+    return 0
+  except ResponseError as e:
+    # Without an address, the failure could have been anywhere.
+    page_size = regions.device.page_size
+    first_page = e.addr / page_size if e.addr is not None else 0
+    out.log("Writing failed: %s. Resuming from %s section address %06Xh..." % (e, SECTION_NAMES[section], first_page * page_size))
+  rewrite_differing(pdi, section, regions, out, first_page)
+  return regions.writes[section][1] if plan.strategy == ERASE_SECTION else 0
+
+class VerificationError(PDIProgrammerError):
+  pass
+
+def verify_section(pdi, section, image_crc):
+  actual, expected = pdi.verify_crc(section)
+  if actual != image_crc:
+    raise VerificationError("verification failed: %s section CRC is %06X, image CRC is %06X" % (SECTION_NAMES[section], actual, image_crc))
+  if expected is not None and expected != image_crc:
+    raise PDIProgrammerError("programmer received a different %s section image (CRC %06X)" % (SECTION_NAMES[section], expected))
+
+def verify_or_repair(pdi, section, regions, out):
+  """Verify `section`. A PDI write can be corrupted without the programmer
+  knowing, so if the CRC is wrong, find the pages that differ by their
+  digests, rewrite them and verify again."""
+  for attempt in range(RESUME_ATTEMPTS + 1):
+    try:
+      verify_section(pdi, section, regions.section_crc(section))
+      return
+    except VerificationError as e:
+      if attempt == RESUME_ATTEMPTS:
+        raise
+      out.log("%s; rewriting pages that differ..." % e)
+      rewrite_differing(pdi, section, regions, out)
+
+def program(pdi, regions, incremental=False, out=Output()):
+  """Program `regions` in a single session. Only the flash sections the image
+  covers are touched, each either erased as a whole or, with `incremental`,
+  rewritten just where it differs if plan_section expects that to be
+  quicker. The EEPROM is only written where the image has data, skipping
+  pages that already match. Fuses go last, so that nothing they change can
+  affect the rest. `regions` must have been prepared."""
+  sent_before = pdi.link.bytes_sent
+  sections = sorted(regions.flash)
+  flash_before = pdi.flash_bytes
+  if sections:
+    start = time.time()
+    host_skipped = 0
+    for section in sections:
+      plan = plan_writing(pdi, section, regions, incremental, out)
+      host_skipped += write_planned(pdi, section, regions, plan, out)
+    out.log("Skipped %d blank pages on the host link and %d on the PDI link." % (host_skipped, pdi.pages_skipped))
+    report_flash_rate(pdi, pdi.flash_bytes - flash_before, time.time() - start, out)
+  for section in sections:
+    out.log("Verifying %s section..." % SECTION_NAMES[section])
+    verify_or_repair(pdi, section, regions, out)
+  write_extras(pdi, regions, out)
+  pdi.wait()
+  out.log("Sent %d bytes over the host link for %d bytes of image data." % (pdi.link.bytes_sent - sent_before, regions.image_bytes()))
+
+def write_extras(pdi, regions, out):
+  """Write the user signature row, EEPROM, fuses and lock bits."""
+  if regions.user_sig is not None:
+    out.log("Writing user signature row...")
+    pdi.write_user_sig(regions.user_sig.flat())
+    pdi.wait()
+
+  if regions.eeprom is not None:
+    out.log("Writing %d EEPROM pages..." % len(regions.eeprom))
+    unchanged = 0
+    for addr, page in regions.eeprom.items():
+      unchanged += pdi.write_eeprom(addr, page)
+    out.log("Updated %d of %d EEPROM pages." % (len(regions.eeprom) - unchanged, len(regions.eeprom)))
+
+  if regions.fuses or regions.lock is not None:
+    out.log("Writing fuses...")
+    written, previous = pdi.write_fuses(regions.fuses, regions.lock)
+    for key in sorted(written):
+      value = regions.lock if key == LOCK_BITS else regions.fuses[key]
+      name = key if key == LOCK_BITS else "fuse %d" % key
+      out.log("Wrote %s: %02Xh (was %02Xh)." % (name, value, previous[key]))
+    out.log("Left %d of %d fuse bytes that already held their values." % (len(previous) - len(written), len(previous)))
+
+def program_panel(pdi, regions, targets, incremental=False, out=Output()):
+  """Program `regions` into each of `targets`, all attached to the one
+  programmer, as program() does for one. Flash pages are sent once for all of
+  them, and the programmer loads each page into one target while the others
+  are busy committing theirs. A target that fails is dropped and the rest
+  carried on with. Returns {target: error} for those that failed."""
+  sent_before = pdi.link.bytes_sent
+  failed = {}
+  live = list(targets)
+
+  def each(step):
+    for target in list(live):
+      try:
+        pdi.select_target(target)
+        step(TargetOutput(target, out))
+      except PDIProgrammerError as e:
+        pdi.pending = []
+        failed[target] = str(e)
+        live.remove(target)
+        out.log("Target %d failed: %s" % (target, e))
+
+  sections = sorted(regions.flash)
+  flash_before = pdi.flash_bytes
+  if sections and incremental:
+    # Each target gets its own plan, from what it already holds.
+    start = time.time()
+    for section in sections:
+      each(lambda t_out: write_planned(pdi, section, regions, plan_writing(pdi, section, regions, True, t_out), t_out))
+  elif sections:
+    start = time.time()
+    host_skipped = 0
+    for section in sections:
+      # Nothing is known of any target, so one plan does for all of them.
+      plan = plan_writing(pdi, section, regions, False, out)
+      pdi.failed_targets.clear()
+      if plan.strategy == ERASE_SECTION:
+        # The programmer does not wait for an erase to finish, so the targets
+        # all erase at once.
+        each(lambda t_out: pdi.erase_section(section))
+        host_skipped += write_section(pdi, section, regions, out, live)
+      else:
+        rewrite_pages(pdi, section, regions, plan.pages, out, live)
+      for target in sorted(pdi.failed_targets):
+        failed[target] = "writing %s section failed" % SECTION_NAMES[section]
+        live.remove(target)
+        out.log("Target %d failed: %s" % (target, failed[target]))
+    out.log("Skipped %d blank pages on the host link and %d on the PDI link." % (host_skipped, pdi.pages_skipped))
+  if sections:
+    report_flash_rate(pdi, pdi.flash_bytes - flash_before, time.time() - start, out)
+
+  def finish(t_out):
+    for section in sections:
+      t_out.log("Verifying %s section..." % SECTION_NAMES[section])
+      verify_or_repair(pdi, section, regions, t_out)
+    write_extras(pdi, regions, t_out)
+    pdi.wait()
+  each(finish)
+
+  out.log("Sent %d bytes over the host link for %d bytes of image data on %d targets." % (pdi.link.bytes_sent - sent_before, regions.image_bytes(), len(targets)))
+  return failed
+
+def parse_fuse(arg):
+  fuse, value = arg.split("=")
+  return int(fuse, 0), int(value, 0)
+
+def attach(pdi, out):
+  clock, guard_time = pdi.attach()
+  out.log("PDI clock %d Hz, guard time %d cycles." % (clock, guard_time))
+  out.log("Target is %s." % pdi.device.describe())
+
+def run_panel(pdi, args, image, out):
+  """Program the first `args.targets` targets of a programmer with several
+  PDI channels. They are written together, so they must all be the same
+  device; any that are not the same as the first are failed."""
+  targets = range(args.targets)
+  failed = {}
+  device = None
+  for target in targets:
+    pdi.select_target(target)
+    t_out = TargetOutput(target, out)
+    attach(pdi, t_out)
+    if device is None:
+      device = pdi.device
+    elif pdi.device.signature != device.signature:
+      failed[target] = "%s, not %s" % (pdi.device, device)
+      t_out.log("Target %d failed: %s" % (target, failed[target]))
+      continue
+    if args.erase_chip:
+      t_out.log("Erasing chip...")
+      pdi.erase_chip()
+    if args.erase_eeprom:
+      t_out.log("Erasing EEPROM...")
+      pdi.erase_eeprom()
+  regions = image.regions(device)
+  failed.update(program_panel(pdi, regions, [t for t in targets if t not in failed], args.incremental, out))
+  pdi.select_target(0)
+  if failed:
+    raise PDIProgrammerError("%d of %d targets failed (%s)" % (len(failed), len(targets), ", ".join(str(t) for t in sorted(failed))))
+
+def run_job(port, args, image, out):
+  """Program the board attached to the programmer on `port`."""
+  ser = serial.Serial(port, DEFAULT_BAUD, timeout=0.05, rtscts=args.rtscts)
   try:
     pdi = PDIProgrammer(ser)
     try:
-      print "Synchronising..."
+      out.log("Synchronising...")
       pdi.sync()
-      print "Erasing chip..."
-      pdi.erase_chip()
-      addr = 0
-      total = len(program)
-      while len(program):
-        chunk = program[:512]
-        program = program[len(chunk):]
-        perc = (addr * 100) / total
-        print "Writing %d bytes at address %06Xh (%d%% complete)" % (len(chunk), addr, perc)
-        pdi.write_app_flash(addr, chunk)
-        addr += len(chunk)
-      print "Writing fuses..."
-      for fuse in [1, 2, 4, 5]:
-        pdi.write_fuse(fuse, 0xff)
-      print "Done."
+      rate = pdi.negotiate_baud(args.max_baud)
+      out.log("Host link running at %d baud." % rate)
+      pdi.stats(reset=True)
+      if args.targets > 1:
+        run_panel(pdi, args, image, out)
+      else:
+        attach(pdi, out)
+        regions = image.regions(pdi.device)
+        if args.erase_chip:
+          out.log("Erasing chip...")
+          pdi.erase_chip()
+        if args.erase_eeprom:
+          out.log("Erasing EEPROM...")
+          pdi.erase_eeprom()
+        program(pdi, regions, args.incremental, out)
+      if image.loads:
+        counters = pdi.stats().counters
+        out.log("Waited for the NVM controller %d times (%d status polls)." % (counters["nvm_waits"], counters["busy_polls"]))
+      if args.read_eeprom is not None:
+        out.log("Reading EEPROM...")
+        with open(args.read_eeprom, "wb") as f:
+          f.write(pdi.read_eeprom(0, pdi.device.eeprom_size))
+      if args.dump is not None:
+        addr, length = int(args.dump[0], 0), int(args.dump[1], 0)
+        out.log("Reading %d bytes from %06Xh..." % (length, addr))
+        with open(args.dump[2], "wb") as f:
+          elided = pdi.read_memory(addr, length, f)
+        out.log("%d of %d bytes were erased." % (elided, length))
+      if args.stats:
+        out.log(pdi.stats().format())
+      out.log("Done.")
     finally:
       try:
+        pdi.pending = []
         pdi.close()
       except PDIProgrammerError:
         pass
   finally:
     ser.close()
 
+def main():
+  parser = argparse.ArgumentParser(description="Program an XMEGA over PDI.")
+  parser.add_argument("image", nargs="?",
+    help="Intel HEX or ELF image (which may cover flash, EEPROM, fuses and "
+         "the user signature row), or a raw binary for the application "
+         "section")
+  parser.add_argument("--port", action="append",
+    help="serial port of a programmer (default: /dev/ttyUSB0); give more "
+         "than once to program several boards at the same time")
+  parser.add_argument("--all-ports", action="store_true",
+    help="use every USB serial port as a programmer")
+  parser.add_argument("--targets", type=int, default=1, metavar="N",
+    help="program the first N targets of each programmer, on programmers "
+         "with several PDI channels (default: %(default)s)")
+  parser.add_argument("--max-baud", type=int, default=1000000,
+    help="fastest host link rate to try (default: %(default)s)")
+  parser.add_argument("--rtscts", action="store_true",
+    help="let the programmer pause the host link, on serial adapters with "
+         "CTS wired to its RTS line (PB0)")
+  parser.add_argument("--no-sparse", dest="sparse", action="store_false",
+    help="send blank (all 0xFF) pages of the image too")
+  parser.add_argument("--no-compress", dest="compressed", action="store_false",
+    help="send flash data as it is, rather than compressed")
+  parser.add_argument("--boot", metavar="FILE",
+    help="image to write to the boot section")
+  parser.add_argument("--user-sig", metavar="FILE",
+    help="image to write to the user signature row")
+  parser.add_argument("--fuse", action="append", type=parse_fuse, default=[],
+    metavar="N=VALUE", help="write VALUE to fuse byte N (may be repeated), "
+         "unless it already holds it")
+  parser.add_argument("--lock", type=lambda arg: int(arg, 0), metavar="VALUE",
+    help="program the lock bits to VALUE, after everything else (only "
+         "--erase-chip can clear them again)")
+  parser.add_argument("--erase-chip", action="store_true",
+    help="erase the whole chip first, including the lock bits")
+  parser.add_argument("--incremental", action="store_true",
+    help="check what the flash holds, and rather than erasing each section "
+         "only rewrite the pages that differ from the images, when that is "
+         "quicker")
+  parser.add_argument("--eeprom", metavar="FILE",
+    help="image to write to the EEPROM (pages that already match are not "
+         "rewritten)")
+  parser.add_argument("--erase-eeprom", action="store_true",
+    help="erase the whole EEPROM (before writing --eeprom, if given)")
+  parser.add_argument("--read-eeprom", metavar="FILE",
+    help="read the whole EEPROM into FILE")
+  parser.add_argument("--stats", action="store_true",
+    help="show where the programmer spent its time")
+  parser.add_argument("--dump", nargs=3, metavar=("ADDR", "LEN", "FILE"),
+    help="read LEN bytes of target memory starting at PDI address ADDR "
+         "(e.g. 0x800000 for flash) into FILE")
+  args = parser.parse_args()
+
+  image = Image()
+  try:
+    if args.image is not None:
+      image.fuses.update(DEFAULT_FUSES)
+      segments = read_segments(args.image)
+      if segments is None:
+        segments = read_region(args.image)
+        image.loads.append(lambda regions: load_region(regions.flash_map(SECTION_APP), segments, 0))
+      else:
+        image.loads.append(lambda regions: [add_segment(regions, addr, data) for addr, data in segments])
+    if args.boot is not None:
+      boot = read_region(args.boot)
+      image.loads.append(lambda regions: load_region(regions.flash_map(SECTION_BOOT), boot, regions.device.app_size))
+    if args.user_sig is not None:
+      user_sig = read_region(args.user_sig)
+      image.loads.append(lambda regions: load_region(regions.user_sig_map(), user_sig, USER_SIG_OFFSET))
+    if args.eeprom is not None:
+      eeprom = read_region(args.eeprom)
+      image.loads.append(lambda regions: load_region(regions.eeprom_map(), eeprom, EEPROM_OFFSET))
+  except (ImageError, IOError) as e:
+    sys.exit("error: %s" % e)
+  image.fuses.update(dict(args.fuse))
+  if args.lock is not None:
+    image.lock = args.lock
+  if any(not 0 <= fuse < FUSE_COUNT for fuse in image.fuses):
+    parser.error("there are only fuse bytes 0 to %d" % (FUSE_COUNT - 1))
+  image.sparse = args.sparse
+  image.compressed = args.compressed
+
+  if args.all_ports:
+    ports = discover_ports()
+    if not ports:
+      sys.exit("error: no USB serial ports found")
+  else:
+    ports = args.port or ["/dev/ttyUSB0"]
+
+  if args.targets > 1 and (args.read_eeprom is not None or args.dump is not None):
+    parser.error("--read-eeprom and --dump only work with a single target")
+  if len(ports) == 1:
+    try:
+      run_job(ports[0], args, image, Output())
+    except PDIProgrammerError as e:
+      sys.exit("error: %s" % e)
+    return
+
+  if args.read_eeprom is not None or args.dump is not None:
+    parser.error("--read-eeprom and --dump only work with a single port")
+  start = time.time()
+  results = run_all(ports, lambda port, out: run_job(port, args, image, out))
+  report(results, time.time() - start)
+  if not all(result.ok for result in results):
+    sys.exit(1)
+
 if __name__ == "__main__":
   main()
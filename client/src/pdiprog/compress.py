@@ -0,0 +1,68 @@
+"""Compression of flash data for WRITE_FLASH_COMPRESSED requests, in the
+format the programmer decodes (see src/Decompressor.hpp)."""
+
+WINDOW_SIZE = 256
+MIN_COPY = 3
+MAX_COPY = 130
+MAX_LITERALS = 128
+# Earlier occurrences of a 3-byte string to try extending, most recent first.
+MAX_CANDIDATES = 32
+
+def compress(data):
+  """Greedy LZ77 encoding of `data`. The window starts out full of 0xFF, as
+  the programmer's does."""
+  buf = bytearray("\xff" * WINDOW_SIZE) + bytearray(data)
+  end = len(buf)
+  out = bytearray()
+  literals = bytearray()
+  # Positions of each 3-byte string seen so far.
+  chains = {}
+
+  def flush_literals():
+    for i in range(0, len(literals), MAX_LITERALS):
+      run = literals[i:i + MAX_LITERALS]
+      out.append(len(run) - 1)
+      out.extend(run)
+    del literals[:]
+
+  def insert(pos):
+    if pos + MIN_COPY <= end:
+      chains.setdefault(bytes(buf[pos:pos + MIN_COPY]), []).append(pos)
+
+  for pos in range(WINDOW_SIZE - MIN_COPY, WINDOW_SIZE):
+    insert(pos)
+
+  pos = WINDOW_SIZE
+  while pos < end:
+    best_len, best_dist = 0, 0
+    if pos + MIN_COPY <= end:
+      chain = chains.get(bytes(buf[pos:pos + MIN_COPY]), [])
+      limit = min(MAX_COPY, end - pos)
+      for cand in reversed(chain[-MAX_CANDIDATES:]):
+        dist = pos - cand
+        if dist > WINDOW_SIZE:
+          break
+        # Only a longer match is of any use.
+        if buf[cand + best_len] != buf[pos + best_len]:
+          continue
+        n = MIN_COPY
+        while n < limit and buf[cand + n] == buf[pos + n]:
+          n += 1
+        if n > best_len:
+          best_len, best_dist = n, dist
+          if n == limit:
+            break
+
+    if best_len >= MIN_COPY:
+      flush_literals()
+      out.append(0x80 | (best_len - MIN_COPY))
+      out.append(best_dist - 1)
+      for i in range(best_len):
+        insert(pos + i)
+      pos += best_len
+    else:
+      literals.append(buf[pos])
+      insert(pos)
+      pos += 1
+  flush_literals()
+  return str(out)
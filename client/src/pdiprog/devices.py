@@ -0,0 +1,65 @@
+"""The XMEGA devices the programmer knows the memory sizes of (see
+TargetConfig::DEVICES in src/TargetConfig.hpp), and the sizes it reports on
+attaching to one."""
+
+# Device signature (MCU.DEVID0-2) -> name.
+NAMES = {
+  0x1E964E: "ATxmega64A1(U)",
+  0x1E974C: "ATxmega128A1(U)",
+  0x1E974E: "ATxmega192A1",
+  0x1E9846: "ATxmega256A1",
+  0x1E9642: "ATxmega64A3(U)",
+  0x1E9742: "ATxmega128A3(U)",
+  0x1E9744: "ATxmega192A3(U)",
+  0x1E9842: "ATxmega256A3(U)",
+  0x1E9843: "ATxmega256A3B(U)",
+  0x1E9441: "ATxmega16A4(U)",
+  0x1E9541: "ATxmega32A4(U)",
+  0x1E9646: "ATxmega64A4U",
+  0x1E9746: "ATxmega128A4U",
+  0x1E964A: "ATxmega64D3",
+  0x1E9748: "ATxmega128D3",
+  0x1E9749: "ATxmega192D3",
+  0x1E9844: "ATxmega256D3",
+  0x1E9442: "ATxmega16D4",
+  0x1E9542: "ATxmega32D4",
+  0x1E9647: "ATxmega64D4",
+  0x1E9747: "ATxmega128D4",
+  0x1E9341: "ATxmega8E5",
+  0x1E9445: "ATxmega16E5",
+  0x1E954C: "ATxmega32E5",
+}
+
+class Device(object):
+  """An attached target. The sizes are in bytes, and all 0 if the programmer
+  does not know the device."""
+
+  def __init__(self, signature, page_size, app_pages, boot_pages, eeprom_size):
+    self.signature = signature
+    self.page_size = page_size
+    self.app_size = app_pages * page_size
+    self.boot_size = boot_pages * page_size
+    self.eeprom_size = eeprom_size
+    # The user signature row is one flash page.
+    self.user_sig_size = page_size
+
+  @property
+  def known(self):
+    return self.page_size != 0
+
+  @property
+  def layout(self):
+    """What an image has to be laid out for; devices with the same layout
+    take the same one."""
+    return (self.page_size, self.app_size, self.boot_size, self.eeprom_size)
+
+  def __str__(self):
+    if not self.signature:
+      return "unidentified device"
+    return "%s (signature %06Xh)" % (NAMES.get(self.signature, "unknown device"), self.signature)
+
+  def describe(self):
+    if not self.known:
+      return "%s, not supported by the programmer" % self
+    return "%s: %d-byte flash pages, %d kB application and %d kB boot sections, %d bytes of EEPROM" % (
+      self, self.page_size, self.app_size / 1024, self.boot_size / 1024, self.eeprom_size)
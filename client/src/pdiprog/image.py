@@ -0,0 +1,130 @@
+"""Reading program images into sparse page maps."""
+
+import struct
+
+class ImageError(Exception):
+  pass
+
+class PageMap(object):
+  """Sparse contents of a memory region. Pages hold 0xFF wherever the image
+  gave no data, and pages with no data at all are not stored."""
+
+  def __init__(self, page_size, size):
+    self.page_size = page_size
+    self.size = size
+    self.pages = {}
+    # Bytes actually given by the image.
+    self.image_bytes = 0
+
+  @classmethod
+  def from_bytes(cls, page_size, size, data):
+    pm = cls(page_size, size)
+    pm.write(0, data)
+    return pm
+
+  def write(self, offset, data):
+    data = bytearray(data)
+    if offset < 0 or offset + len(data) > self.size:
+      raise ImageError("data at offset %X (%d bytes) does not fit in %d bytes" % (offset, len(data), self.size))
+    self.image_bytes += len(data)
+    pos = 0
+    while pos < len(data):
+      addr = offset + pos
+      page_addr = addr - addr % self.page_size
+      page = self.pages.get(page_addr)
+      if page is None:
+        page = self.pages[page_addr] = bytearray("\xff" * self.page_size)
+      start = addr - page_addr
+      n = min(len(data) - pos, self.page_size - start)
+      page[start:start + n] = data[pos:pos + n]
+      pos += n
+
+  def page(self, page_addr):
+    """Contents of the page at `page_addr`, populated or not."""
+    page = self.pages.get(page_addr)
+    return str(page) if page is not None else "\xff" * self.page_size
+
+  def items(self):
+    """(address, contents) of each populated page, in address order."""
+    return [(addr, str(self.pages[addr])) for addr in sorted(self.pages)]
+
+  def flat(self):
+    """Contents from the start of the region to the end of the last populated
+    page."""
+    if not self.pages:
+      return ""
+    end = max(self.pages) + self.page_size
+    return "".join(self.page(addr) for addr in range(0, end, self.page_size))
+
+  def __len__(self):
+    return len(self.pages)
+
+def read_hex(f):
+  """Returns the (address, data) segments of an Intel HEX file."""
+  segments = []
+  base = 0
+  for lineno, line in enumerate(f, 1):
+    line = line.strip()
+    if not line:
+      continue
+    if not line.startswith(":"):
+      raise ImageError("line %d: not an Intel HEX record" % lineno)
+    try:
+      record = bytearray(line[1:].decode("hex"))
+    except TypeError:
+      raise ImageError("line %d: bad hex digits" % lineno)
+    if len(record) < 5 or len(record) != record[0] + 5:
+      raise ImageError("line %d: bad record length" % lineno)
+    if sum(record) & 0xFF:
+      raise ImageError("line %d: bad checksum" % lineno)
+    length, kind = record[0], record[3]
+    addr = (record[1] << 8) | record[2]
+    data = record[4:4 + length]
+    if kind == 0x00:
+      segments.append((base + addr, data))
+    elif kind == 0x01:
+      break
+    elif kind == 0x02:
+      base = ((data[0] << 8) | data[1]) << 4
+    elif kind == 0x04:
+      base = ((data[0] << 8) | data[1]) << 16
+    elif kind in (0x03, 0x05):
+      # Start address; irrelevant to programming.
+      pass
+    else:
+      raise ImageError("line %d: unknown record type %02X" % (lineno, kind))
+  return segments
+
+ELF_MAGIC = "\x7fELF"
+PT_LOAD = 1
+
+def read_elf(f):
+  """Returns the (load address, data) segments of a 32-bit little-endian ELF
+  file, as produced by avr-gcc."""
+  elf = f.read()
+  if elf[:4] != ELF_MAGIC:
+    raise ImageError("not an ELF file")
+  if ord(elf[4]) != 1 or ord(elf[5]) != 1:
+    raise ImageError("only 32-bit little-endian ELF files are supported")
+  phoff, = struct.unpack_from("<I", elf, 28)
+  phentsize, phnum = struct.unpack_from("<HH", elf, 42)
+  segments = []
+  for i in range(phnum):
+    kind, offset, vaddr, paddr, filesz = struct.unpack_from("<IIIII", elf, phoff + i * phentsize)
+    if kind != PT_LOAD or filesz == 0:
+      continue
+    # The physical (load) address is where initialised data lives in flash.
+    segments.append((paddr, bytearray(elf[offset:offset + filesz])))
+  return segments
+
+def read_segments(path):
+  """Returns the (address, data) segments of a HEX or ELF file, or None if it
+  is neither (i.e. a raw binary)."""
+  with open(path, "rb") as f:
+    if f.read(4) == ELF_MAGIC:
+      f.seek(0)
+      return read_elf(f)
+  if path.lower().endswith((".hex", ".ihex", ".ihx", ".eep")):
+    with open(path, "r") as f:
+      return read_hex(f)
+  return None
@@ -0,0 +1,68 @@
+"""Choosing how to get a flash section to hold an image: erasing the whole
+section and writing the image's pages into it, or erasing and writing only
+the pages that need it. Each is costed from the typical duration of the NVM
+commands it takes and the time to send the data, and the cheaper one used."""
+
+# What the target is known to hold in each page of a section.
+SAME = "same"       # what the image has there
+BLANK = "blank"     # nothing (all 0xFF)
+OTHER = "other"     # something else, or not known
+
+ERASE_SECTION = "erase section"
+REWRITE_PAGES = "rewrite pages"
+
+class Costs(object):
+  """Typical NVM command durations in seconds, from the XMEGA A datasheet,
+  and the host link rate flash data is sent at."""
+
+  def __init__(self, baud, section_erase=0.006, page_erase=0.004,
+               page_write=0.004, page_erase_write=0.008):
+    self.baud = baud
+    self.section_erase = section_erase
+    self.page_erase = page_erase
+    self.page_write = page_write
+    self.page_erase_write = page_erase_write
+
+  def send(self, size):
+    # Ten bits a byte, and about as much again in framing and waiting for
+    # acknowledgements, going by measured flash write rates.
+    return size * 20.0 / self.baud
+
+  def page(self, command, size):
+    """Time to send `size` bytes of a page and have `command` commit it. The
+    programmer receives the next page while the target commits this one, so
+    whichever is slower sets the pace."""
+    return max(command, self.send(size))
+
+class Plan(object):
+  def __init__(self, strategy, cost, pages):
+    self.strategy = strategy
+    # Estimated seconds.
+    self.cost = cost
+    # For REWRITE_PAGES, the indices of the pages to erase and write.
+    self.pages = pages
+
+def plan_section(states, sizes, costs):
+  """Plan writing a section, given the `states` of its pages and the `sizes`
+  in bytes of what must be sent for each page of the image (0 for a blank
+  page, which need not be written after an erase)."""
+  erase = costs.section_erase + sum(costs.page(costs.page_write, size) for size in sizes if size)
+
+  rewrite = 0.0
+  pages = []
+  for i, (state, size) in enumerate(zip(states, sizes)):
+    if state == SAME:
+      continue
+    pages.append(i)
+    # The programmer leaves out erasing a page it has seen to be blank, and
+    # only erases a page the image leaves blank.
+    if not size:
+      rewrite += costs.page_erase
+    elif state == BLANK:
+      rewrite += costs.page(costs.page_write, size)
+    else:
+      rewrite += costs.page(costs.page_erase_write, size)
+
+  if rewrite < erase:
+    return Plan(REWRITE_PAGES, rewrite, pages)
+  return Plan(ERASE_SECTION, erase, None)
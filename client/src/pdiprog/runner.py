@@ -0,0 +1,83 @@
+"""Programming several boards at once, one programmer per serial port."""
+
+import sys, threading, time
+
+from serial.tools import list_ports
+
+def discover_ports():
+  """Serial ports that belong to USB devices, as programmers do."""
+  return sorted(p.device for p in list_ports.comports() if p.vid is not None)
+
+class PortOutput(object):
+  """Output for the job on one port. Lines are prefixed with the port, and
+  page-by-page progress is shown at most every PROGRESS_INTERVAL seconds so
+  that the ports' messages stay readable together."""
+
+  PROGRESS_INTERVAL = 1.0
+
+  def __init__(self, port, lock):
+    self.port = port
+    self.lock = lock
+    self.last_progress = 0
+
+  def log(self, msg):
+    with self.lock:
+      for line in msg.split("\n"):
+        print "[%s] %s" % (self.port, line)
+      sys.stdout.flush()
+
+  def progress(self, msg):
+    now = time.time()
+    if now - self.last_progress >= self.PROGRESS_INTERVAL:
+      self.last_progress = now
+      self.log(msg)
+
+class Result(object):
+  def __init__(self, port, error, seconds):
+    self.port = port
+    # None on success.
+    self.error = error
+    self.seconds = seconds
+
+  @property
+  def ok(self):
+    return self.error is None
+
+def run_all(ports, job):
+  """Call job(port, output) for every port at once, each in its own thread,
+  and return their Results in port order. The jobs share nothing but what
+  `job` gives them, so none waits for another."""
+  lock = threading.Lock()
+  results = {}
+
+  def worker(port):
+    out = PortOutput(port, lock)
+    start = time.time()
+    try:
+      job(port, out)
+      results[port] = Result(port, None, time.time() - start)
+    except Exception as e:
+      error = str(e) or e.__class__.__name__
+      out.log("Failed: %s" % error)
+      results[port] = Result(port, error, time.time() - start)
+
+  threads = [threading.Thread(target=worker, args=(port,), name=port) for port in ports]
+  for thread in threads:
+    # Let Ctrl-C end the program rather than waiting for the jobs.
+    thread.daemon = True
+    thread.start()
+  for thread in threads:
+    # Joining with a timeout keeps the main thread responsive to Ctrl-C.
+    while thread.is_alive():
+      thread.join(0.2)
+  return [results[port] for port in ports]
+
+def report(results, elapsed):
+  """Print the outcome for each port and the overall rate."""
+  print
+  for result in results:
+    status = "ok" if result.ok else "FAILED: %s" % result.error
+    print "%-20s %6.1f s  %s" % (result.port, result.seconds, status)
+  done = sum(1 for result in results if result.ok)
+  print "%d of %d boards programmed in %.1f s (%.0f boards/hour)." % (
+    done, len(results), elapsed, done * 3600 / elapsed if elapsed else 0)
@@ -28,9 +28,16 @@ LD_FLAGS="${LD_FLAGS:-} -Wall -Werror"
 C_FLAGS="${C_FLAGS:-} -std=c11"
 CPP_FLAGS="${CPP_FLAGS:-} -std=c++11"
 
+# Platforms that are not AVR-based set TOOLCHAIN_PREFIX (possibly to nothing)
+# and leave MCU empty.
+TOOLCHAIN_PREFIX=avr-
+MCU=
+
 source $platform_dir/vars.sh
 
 # Device
-CC_FLAGS="${CC_FLAGS:-} -mmcu=$MCU"
-LD_FLAGS="${LD_FLAGS:-} -mmcu=$MCU"
-AVRDUDE_FLAGS="${AVRDUDE_FLAGS:-} -p $MCU"
+if [ -n "$MCU" ]; then
+  CC_FLAGS="${CC_FLAGS:-} -mmcu=$MCU"
+  LD_FLAGS="${LD_FLAGS:-} -mmcu=$MCU"
+  AVRDUDE_FLAGS="${AVRDUDE_FLAGS:-} -p $MCU"
+fi
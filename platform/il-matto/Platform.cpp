@@ -1,7 +1,9 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <avr/interrupt.h>
 #include <avr/io.h>
+#include <util/atomic.h>
 
 #include "PDI.hpp"
 #include "PDIPin.hpp"
@@ -48,11 +50,44 @@ bool Platform::Pin::read(PDIPin pin) {
   return *PIN & pinMask(pin);
 }
 
+// For programming several targets, PDI_DATA can be routed through an analog
+// switch (such as a 74HC4052) addressed by PC0 and PC1, with the PDI clock
+// going to every target. Build with CC_FLAGS=-DPDIPROG_CHANNELS=4 for that.
+static_assert(PDIPROG_CHANNELS <= 4, "the switch has 4 channels");
+
+static volatile uint8_t * const SELECT_DDR = &DDRC;
+static volatile uint8_t * const SELECT_PORT = &PORTC;
+static const uint8_t SELECT_MASK = _BV(0) | _BV(1);
+
 void Platform::TargetSerial::init() {
-  UBRR1 = (F_CPU / (2 * PDI::BAUD_RATE)) - 1;
   UCSR1A = 0;
   UCSR1B = 0;
   UCSR1C = _BV(UPM11) | _BV(USBS1) | _BV(UCSZ11) | _BV(UCSZ10) | _BV(UCPOL1);
+
+  if (PDIPROG_CHANNELS > 1) {
+    *SELECT_PORT &= ~SELECT_MASK;
+    *SELECT_DDR |= SELECT_MASK;
+  }
+}
+
+uint8_t Platform::TargetSerial::channels() {
+  return PDIPROG_CHANNELS;
+}
+
+void Platform::TargetSerial::select(uint8_t channel) {
+  if (PDIPROG_CHANNELS > 1) {
+    *SELECT_PORT = (*SELECT_PORT & ~SELECT_MASK) | (channel & SELECT_MASK);
+  }
+}
+
+uint32_t Platform::TargetSerial::setBaudRate(uint32_t baud) {
+  // Synchronous master mode: rate = F_CPU / (2 * (UBRR + 1)).
+  uint32_t ubrr = (F_CPU / 2 + baud - 1) / baud - 1;
+  if (ubrr > 0x0FFF) {
+    ubrr = 0x0FFF;
+  }
+  UBRR1 = ubrr;
+  return F_CPU / (2 * (ubrr + 1));
 }
 
 void Platform::TargetSerial::enableClock() {
@@ -107,26 +142,167 @@ uint8_t Platform::TargetSerial::readData() {
   return UDR1;
 }
 
-void Platform::ClientSerial::init() {
-  static const uint32_t BAUD = 57600;
-  UBRR0H = (F_CPU/(BAUD*16L)-1) >> 8;
-  UBRR0L = (F_CPU/(BAUD*16L)-1);
-  UCSR0B = _BV(RXEN0) | _BV(TXEN0);
+// Host link flow control: RTS (active low, PB0) is driven high while the
+// receive buffer is nearly full, asking the host to pause. This only works with
+// the host's CTS wired to it and the client run with --rtscts; otherwise the
+// link's receive window keeps the buffer from overflowing.
+static volatile uint8_t * const RTS_DDR = &DDRB;
+static volatile uint8_t * const RTS_PORT = &PORTB;
+static const uint8_t RTS_MASK = _BV(0);
+
+static const uint16_t RX_BUFFER_SIZE = 512;
+static const uint16_t RX_HIGH_WATER = RX_BUFFER_SIZE - 64;
+static const uint16_t RX_LOW_WATER = RX_BUFFER_SIZE / 2;
+static const uint8_t TX_BUFFER_SIZE = 128;
+
+static_assert((RX_BUFFER_SIZE & (RX_BUFFER_SIZE - 1)) == 0, "RX_BUFFER_SIZE must be a power of two");
+static_assert((TX_BUFFER_SIZE & (TX_BUFFER_SIZE - 1)) == 0, "TX_BUFFER_SIZE must be a power of two");
+
+static volatile uint8_t rxBuffer[RX_BUFFER_SIZE];
+static volatile uint16_t rxHead = 0;
+static volatile uint16_t rxTail = 0;
+
+static volatile uint8_t txBuffer[TX_BUFFER_SIZE];
+static volatile uint8_t txHead = 0;
+static volatile uint8_t txTail = 0;
+
+ISR(USART0_RX_vect) {
+  const uint8_t data = UDR0;
+  const uint16_t count = rxHead - rxTail;
+  if (count < RX_BUFFER_SIZE) {
+    rxBuffer[rxHead & (RX_BUFFER_SIZE - 1)] = data;
+    rxHead++;
+  }
+  if (count >= RX_HIGH_WATER) {
+    *RTS_PORT |= RTS_MASK;
+  }
+}
+
+static uint32_t currentBaud;
+// TXC0 is only meaningful once something has been transmitted.
+static bool txStarted = false;
+
+ISR(USART0_UDRE_vect) {
+  if (txHead == txTail) {
+    UCSR0B &= ~_BV(UDRIE0);
+  } else {
+    // Clear TXC0. FE0, DOR0 and UPE0 must be written as zero, so UCSR0A is
+    // written whole rather than read back.
+    UCSR0A = _BV(U2X0) | _BV(TXC0);
+    UDR0 = txBuffer[txTail & (TX_BUFFER_SIZE - 1)];
+    txTail++;
+  }
+}
+
+// Baud rate register value in double-speed (U2X) mode, rounded to nearest.
+static uint32_t ubrrForBaud(const uint32_t baud) {
+  return (F_CPU + 4 * baud) / (8 * baud) - 1;
+}
+
+void Platform::ClientSerial::init(uint32_t baud) {
+  rxHead = rxTail = 0;
+  txHead = txTail = 0;
+  *RTS_PORT &= ~RTS_MASK;
+  *RTS_DDR |= RTS_MASK;
+
+  currentBaud = baud;
+  UCSR0A = _BV(U2X0);
+  UBRR0 = ubrrForBaud(baud);
+  UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
   UCSR0C = _BV(UCSZ00) | _BV(UCSZ01);
+  sei();
 }
 
-bool Platform::ClientSerial::rxComplete() {
-  return UCSR0A & _BV(RXC0);
+bool Platform::ClientSerial::baudRateSupported(uint32_t baud) {
+  if (baud == 0 || baud > F_CPU / 8) {
+    return false;
+  }
+  const uint32_t ubrr = ubrrForBaud(baud);
+  if (ubrr > 0x0FFF) {
+    return false;
+  }
+  const uint32_t actual = F_CPU / (8 * (ubrr + 1));
+  const uint32_t error = (actual > baud) ? (actual - baud) : (baud - actual);
+  return error * 50 <= baud;
 }
 
-bool Platform::ClientSerial::txBufferEmpty() {
-  return UCSR0A & _BV(UDRE0);
+void Platform::ClientSerial::setBaudRate(uint32_t baud) {
+  // Let everything already queued go out at the old rate.
+  while (txHead != txTail) {}
+  while (txStarted && !(UCSR0A & _BV(TXC0))) {}
+
+  UCSR0B &= ~(_BV(RXEN0) | _BV(RXCIE0));
+  // TXC0 is left set for the next switch.
+  UCSR0A = _BV(U2X0);
+  UBRR0 = ubrrForBaud(baud);
+  currentBaud = baud;
+  rxHead = rxTail = 0;
+  *RTS_PORT &= ~RTS_MASK;
+  UCSR0B |= _BV(RXEN0) | _BV(RXCIE0);
 }
 
-void Platform::ClientSerial::writeData(uint8_t data) {
-  UDR0 = data;
+uint32_t Platform::ClientSerial::baudRate() {
+  return currentBaud;
 }
 
-uint8_t Platform::ClientSerial::readData() {
-  return UDR0;
+bool Platform::ClientSerial::tryRead(uint8_t * data) {
+  uint16_t head;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    head = rxHead;
+  }
+  const uint16_t tail = rxTail;
+  if (head == tail) {
+    return false;
+  }
+  *data = rxBuffer[tail & (RX_BUFFER_SIZE - 1)];
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    rxTail = tail + 1;
+    if ((uint16_t) (rxHead - rxTail) <= RX_LOW_WATER) {
+      *RTS_PORT &= ~RTS_MASK;
+    }
+  }
+  return true;
+}
+
+bool Platform::ClientSerial::tryWrite(uint8_t data) {
+  const uint8_t head = txHead;
+  if ((uint8_t) (head - txTail) == TX_BUFFER_SIZE) {
+    return false;
+  }
+  txBuffer[head & (TX_BUFFER_SIZE - 1)] = data;
+  txHead = head + 1;
+  txStarted = true;
+  UCSR0B |= _BV(UDRIE0);
+  return true;
+}
+
+static volatile uint16_t timerOverflows = 0;
+
+ISR(TIMER1_OVF_vect) {
+  timerOverflows++;
+}
+
+void Platform::Timer::init() {
+  static_assert(TICK_HZ == F_CPU / 8, "Timer1 runs with a prescaler of 8");
+
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+  TCNT1 = 0;
+  TIFR1 = _BV(TOV1);
+  TIMSK1 = _BV(TOIE1);
+  sei();
+}
+
+uint32_t Platform::Timer::ticks() {
+  uint16_t high;
+  uint16_t low;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    high = timerOverflows;
+    low = TCNT1;
+    // An overflow may have happened since interrupts were disabled.
+    if ((TIFR1 & _BV(TOV1)) && low < 0x8000) {
+      high++;
+    }
+  }
+  return (((uint32_t) high) << 16) | low;
 }
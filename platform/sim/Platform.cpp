@@ -0,0 +1,407 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <util/delay.h>
+
+#include "PDIPin.hpp"
+#include "Platform.hpp"
+#include "Target.hpp"
+
+// Native build for Linux, with a simulated target on the PDI side and a
+// pseudo-terminal on the host side. Both links run at the rates the real
+// hardware would, so that timings are representative.
+//
+// Environment variables:
+//   PDIPROG_SIM_LINK        also make the pseudo-terminal available here
+//   PDIPROG_SIM_ERROR_RATE  probability of each PDI frame being corrupted
+//   PDIPROG_SIM_MAX_CLOCK   PDI clock above which every frame is corrupted
+//   PDIPROG_SIM_TARGETS     number of targets, one per PDI channel (default 1)
+//   PDIPROG_SIM_DEVICE      signature of the targets, in hex (default 1E9744)
+
+static uint64_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t) ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+static void waitUntil(const uint64_t t) {
+  while (now() < t) {}
+}
+
+void _delay_us(double us) {
+  waitUntil(now() + (uint64_t) (us * 1000));
+}
+
+void _delay_ms(double ms) {
+  const struct timespec ts = {
+    (time_t) (ms / 1000),
+    (long) (((uint64_t) (ms * 1000000)) % 1000000000),
+  };
+  nanosleep(&ts, nullptr);
+}
+
+static double envDouble(const char * const name, const double fallback) {
+  const char * const value = getenv(name);
+  return value ? atof(value) : fallback;
+}
+
+// PDI
+
+static constexpr uint8_t PIN_COUNT = 3;
+static bool pinOutput[PIN_COUNT];
+static bool pinState[PIN_COUNT];
+
+static bool clockEnabled = false;
+static uint64_t clockStart;
+static uint32_t targetBaud = 0;
+
+// Time at which the data line was last driven low, for detecting BREAKs.
+static bool dataLow = false;
+static uint64_t dataLowSince;
+
+static uint64_t cyclesToNs(const uint32_t cycles) {
+  return ((uint64_t) cycles) * 1000000000 / targetBaud;
+}
+
+static void dataLineChanged() {
+  const bool low = pinOutput[(uint8_t) PDIPin::TXD] && !pinState[(uint8_t) PDIPin::TXD];
+  if (low && !dataLow) {
+    dataLowSince = now();
+  } else if (!low && dataLow && clockEnabled) {
+    static constexpr uint32_t BREAK_CYCLES = 12;
+    if (now() - dataLowSince >= cyclesToNs(BREAK_CYCLES)) {
+      SimTarget::sendBreak();
+    }
+  }
+  dataLow = low;
+}
+
+void Platform::Pin::configureAsOutput(PDIPin pin, bool initialState) {
+  pinState[(uint8_t) pin] = initialState;
+  pinOutput[(uint8_t) pin] = true;
+  dataLineChanged();
+}
+
+void Platform::Pin::configureAsInput(PDIPin pin) {
+  pinOutput[(uint8_t) pin] = false;
+  pinState[(uint8_t) pin] = false;
+  dataLineChanged();
+}
+
+void Platform::Pin::write(PDIPin pin, bool state) {
+  pinState[(uint8_t) pin] = state;
+  dataLineChanged();
+}
+
+bool Platform::Pin::read(PDIPin pin) {
+  if (pin == PDIPin::CLK && clockEnabled) {
+    // The clock idles high, and falls at the start of each cycle.
+    const unsigned __int128 halfCycles = ((unsigned __int128) (now() - clockStart)) * 2 * targetBaud / 1000000000;
+    return !(halfCycles & 1);
+  }
+  return pinOutput[(uint8_t) pin] && pinState[(uint8_t) pin];
+}
+
+static bool txEnabled = false;
+static bool rxEnabled = false;
+// When the byte being shifted out will be done, and when TXC will be set.
+static uint64_t txBusyUntil = 0;
+static constexpr uint64_t NEVER = UINT64_MAX;
+static uint64_t txCompleteAt = NEVER;
+
+// Frames from the target, each ready to be read at `readyAt`.
+struct Frame {
+  uint8_t data;
+  bool error;
+  uint64_t readyAt;
+};
+static constexpr uint32_t RX_QUEUE_SIZE = 1UL << 18;
+static Frame rxQueue[RX_QUEUE_SIZE];
+static uint32_t rxHead = 0;
+static uint32_t rxTail = 0;
+// When the target's line will next be free.
+static uint64_t targetBusyUntil = 0;
+
+static double errorRate;
+static uint32_t maxClock;
+
+static bool corrupted() {
+  return targetBaud > maxClock || drand48() < errorRate;
+}
+
+// A PDI frame is a start bit, 8 data bits, a parity bit and 2 stop bits.
+static uint64_t frameTime() {
+  static constexpr uint32_t FRAME_CYCLES = 12;
+  return cyclesToNs(FRAME_CYCLES);
+}
+
+void Platform::TargetSerial::init() {
+  errorRate = envDouble("PDIPROG_SIM_ERROR_RATE", 0);
+  maxClock = envDouble("PDIPROG_SIM_MAX_CLOCK", UINT32_MAX);
+  srand48(1);
+  const char * const device = getenv("PDIPROG_SIM_DEVICE");
+  SimTarget::init(envDouble("PDIPROG_SIM_TARGETS", 1), device ? strtoul(device, nullptr, 16) : SimTarget::DEFAULT_SIGNATURE);
+  txEnabled = rxEnabled = false;
+  txCompleteAt = NEVER;
+  rxHead = rxTail = 0;
+}
+
+static_assert(SimTarget::MAX_TARGETS <= Platform::TargetSerial::MAX_CHANNELS, "more targets than channels");
+
+uint8_t Platform::TargetSerial::channels() {
+  return SimTarget::count();
+}
+
+void Platform::TargetSerial::select(uint8_t channel) {
+  SimTarget::select(channel);
+}
+
+uint32_t Platform::TargetSerial::setBaudRate(uint32_t baud) {
+  // As the ATmega644p's USART in synchronous master mode.
+  uint32_t ubrr = (F_CPU / 2 + baud - 1) / baud - 1;
+  if (ubrr > 0x0FFF) {
+    ubrr = 0x0FFF;
+  }
+  targetBaud = F_CPU / (2 * (ubrr + 1));
+  clockStart = now();
+  return targetBaud;
+}
+
+void Platform::TargetSerial::enableClock() {
+  if (clockEnabled) { return; }
+  clockEnabled = true;
+  clockStart = now();
+  SimTarget::enable();
+}
+
+void Platform::TargetSerial::disableClock() {
+  if (!clockEnabled) { return; }
+  clockEnabled = false;
+  SimTarget::disable();
+}
+
+void Platform::TargetSerial::enableTx() {
+  txEnabled = true;
+}
+
+void Platform::TargetSerial::disableTx() {
+  txEnabled = false;
+}
+
+void Platform::TargetSerial::enableRx() {
+  rxEnabled = true;
+}
+
+void Platform::TargetSerial::disableRx() {
+  // The receiver's buffer is flushed.
+  rxEnabled = false;
+  rxHead = rxTail = 0;
+}
+
+bool Platform::TargetSerial::rxComplete() {
+  return rxEnabled && rxHead != rxTail && now() >= rxQueue[rxTail % RX_QUEUE_SIZE].readyAt;
+}
+
+bool Platform::TargetSerial::txComplete() {
+  return now() >= txCompleteAt;
+}
+
+bool Platform::TargetSerial::txBufferEmpty() {
+  // There is room for one byte behind the one being shifted out.
+  return now() + frameTime() >= txBusyUntil;
+}
+
+bool Platform::TargetSerial::rxError() {
+  return rxComplete() && rxQueue[rxTail % RX_QUEUE_SIZE].error;
+}
+
+void Platform::TargetSerial::resetTxComplete() {
+  if (now() >= txCompleteAt) {
+    txCompleteAt = NEVER;
+  }
+}
+
+void Platform::TargetSerial::writeData(uint8_t data) {
+  if (!txEnabled || !clockEnabled) { return; }
+
+  const uint64_t start = (txBusyUntil > now()) ? txBusyUntil : now();
+  txBusyUntil = start + frameTime();
+  txCompleteAt = txBusyUntil;
+
+  if (corrupted()) {
+    SimTarget::receiveError();
+  } else {
+    SimTarget::receive(data, txBusyUntil);
+  }
+
+  // The target turns the line around after the guard time, then sends any
+  // response back to back.
+  uint8_t response;
+  while (SimTarget::transmit(&response)) {
+    const uint64_t turnaround = txBusyUntil + cyclesToNs(SimTarget::guardCycles());
+    const uint64_t frameStart = (targetBusyUntil > turnaround) ? targetBusyUntil : turnaround;
+    targetBusyUntil = frameStart + frameTime();
+    if (rxHead - rxTail < RX_QUEUE_SIZE) {
+      rxQueue[rxHead % RX_QUEUE_SIZE] = { response, corrupted(), targetBusyUntil };
+      rxHead++;
+    }
+  }
+}
+
+uint8_t Platform::TargetSerial::readData() {
+  if (rxHead == rxTail) { return 0; }
+  const uint8_t data = rxQueue[rxTail % RX_QUEUE_SIZE].data;
+  rxTail++;
+  return data;
+}
+
+// Host link, over a pseudo-terminal. Bytes are paced at the baud rate the
+// firmware has set, as the real USART would.
+
+static int ptyFd = -1;
+static uint32_t currentBaud;
+
+// Received bytes, each timestamped with when it would have finished arriving.
+// As with RTS on the real board, nothing more is taken from the
+// pseudo-terminal while this is nearly full.
+static constexpr uint16_t RX_BUFFER_SIZE = 512;
+static uint8_t rxBuffer[RX_BUFFER_SIZE];
+static uint64_t rxArrival[RX_BUFFER_SIZE];
+static uint16_t clientRxHead = 0;
+static uint16_t clientRxTail = 0;
+static uint64_t lastArrival = 0;
+
+static constexpr uint16_t TX_BUFFER_SIZE = 128;
+static uint64_t clientTxBusyUntil = 0;
+
+static uint64_t byteTime() {
+  // Start bit, 8 data bits and a stop bit.
+  return 10ULL * 1000000000 / currentBaud;
+}
+
+// Baud rate register value in double-speed (U2X) mode, rounded to nearest.
+static uint32_t ubrrForBaud(const uint32_t baud) {
+  return (F_CPU + 4 * baud) / (8 * baud) - 1;
+}
+
+void Platform::ClientSerial::init(uint32_t baud) {
+  ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (ptyFd < 0 || grantpt(ptyFd) < 0 || unlockpt(ptyFd) < 0) {
+    perror("sim: pseudo-terminal");
+    exit(1);
+  }
+  const char * path = ptsname(ptyFd);
+
+  // Keep the other end open, so that the host can come and go, and make it
+  // raw from the start.
+  const int slaveFd = open(path, O_RDWR | O_NOCTTY);
+  struct termios tio;
+  if (slaveFd < 0 || tcgetattr(slaveFd, &tio) < 0) {
+    perror("sim: pseudo-terminal");
+    exit(1);
+  }
+  cfmakeraw(&tio);
+  tcsetattr(slaveFd, TCSANOW, &tio);
+  fcntl(ptyFd, F_SETFL, fcntl(ptyFd, F_GETFL) | O_NONBLOCK);
+
+  const char * const link = getenv("PDIPROG_SIM_LINK");
+  if (link) {
+    unlink(link);
+    if (symlink(path, link) < 0) {
+      perror("sim: PDIPROG_SIM_LINK");
+      exit(1);
+    }
+    path = link;
+  }
+  fprintf(stderr, "sim: host link on %s\n", path);
+
+  currentBaud = baud;
+  clientRxHead = clientRxTail = 0;
+}
+
+bool Platform::ClientSerial::baudRateSupported(uint32_t baud) {
+  if (baud == 0 || baud > F_CPU / 8) {
+    return false;
+  }
+  const uint32_t ubrr = ubrrForBaud(baud);
+  if (ubrr > 0x0FFF) {
+    return false;
+  }
+  const uint32_t actual = F_CPU / (8 * (ubrr + 1));
+  const uint32_t error = (actual > baud) ? (actual - baud) : (baud - actual);
+  return error * 50 <= baud;
+}
+
+void Platform::ClientSerial::setBaudRate(uint32_t baud) {
+  // Let everything already queued go out at the old rate.
+  waitUntil(clientTxBusyUntil);
+  currentBaud = baud;
+  clientRxHead = clientRxTail = 0;
+}
+
+uint32_t Platform::ClientSerial::baudRate() {
+  return currentBaud;
+}
+
+static void pollPty() {
+  uint8_t data[RX_BUFFER_SIZE];
+  const uint16_t space = RX_BUFFER_SIZE - (uint16_t) (clientRxHead - clientRxTail);
+  if (space == 0) { return; }
+  const ssize_t count = read(ptyFd, data, space);
+  if (count <= 0) { return; }
+
+  const uint64_t t = now();
+  for (ssize_t i = 0; i < count; i++) {
+    lastArrival = ((lastArrival > t) ? lastArrival : t) + byteTime();
+    rxBuffer[clientRxHead % RX_BUFFER_SIZE] = data[i];
+    rxArrival[clientRxHead % RX_BUFFER_SIZE] = lastArrival;
+    clientRxHead++;
+  }
+}
+
+bool Platform::ClientSerial::tryRead(uint8_t * data) {
+  if (clientRxHead == clientRxTail) {
+    pollPty();
+    if (clientRxHead == clientRxTail) { return false; }
+  }
+  if (now() < rxArrival[clientRxTail % RX_BUFFER_SIZE]) {
+    return false;
+  }
+  *data = rxBuffer[clientRxTail % RX_BUFFER_SIZE];
+  clientRxTail++;
+  return true;
+}
+
+bool Platform::ClientSerial::tryWrite(uint8_t data) {
+  const uint64_t t = now();
+  if (clientTxBusyUntil > t + TX_BUFFER_SIZE * byteTime()) {
+    return false;
+  }
+  const ssize_t count = write(ptyFd, &data, 1);
+  if (count != 1) {
+    if (count < 0 && errno != EAGAIN) {
+      perror("sim: host link");
+    }
+    return false;
+  }
+  clientTxBusyUntil = ((clientTxBusyUntil > t) ? clientTxBusyUntil : t) + byteTime();
+  return true;
+}
+
+static uint64_t timerStart;
+
+void Platform::Timer::init() {
+  timerStart = now();
+}
+
+uint32_t Platform::Timer::ticks() {
+  return ((unsigned __int128) (now() - timerStart)) * TICK_HZ / 1000000000;
+}
@@ -0,0 +1,967 @@
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "CRC.hpp"
+#include "Target.hpp"
+#include "TargetConfig.hpp"
+
+static constexpr uint64_t US = 1000;
+static constexpr uint64_t MS = 1000 * US;
+
+// Typical durations of NVM operations, from the XMEGA A datasheet.
+static constexpr uint64_t PAGE_ERASE_TIME = 4 * MS;
+static constexpr uint64_t PAGE_WRITE_TIME = 4 * MS;
+static constexpr uint64_t PAGE_ERASE_WRITE_TIME = 8 * MS;
+static constexpr uint64_t SECTION_ERASE_TIME = 6 * MS;
+static constexpr uint64_t CHIP_ERASE_TIME = 50 * MS;
+static constexpr uint64_t FUSE_WRITE_TIME = 4 * MS;
+// The CRC commands read a word per NVM clock cycle.
+static constexpr uint64_t CRC_TIME_PER_BYTE = 250;
+// How long the NVM interface takes to come up after the key is accepted.
+static constexpr uint64_t NVMEN_DELAY = 100 * US;
+
+// Memory map. The sizes are those of the simulated device (see init()), and
+// the memories are allocated for the largest.
+static uint32_t flashAppSize;
+static uint32_t flashSize;
+static uint16_t flashPageSize;
+static uint16_t eepromSize;
+static uint16_t userSigSize;
+static constexpr uint32_t MAX_FLASH_SIZE = ((uint32_t) TargetConfig::MAX_FLASH_PAGES) * TargetConfig::MAX_FLASH_PAGE_SIZE;
+static constexpr uint32_t PROD_SIG_START = 0x008E0200;
+static constexpr uint16_t PROD_SIG_SIZE = 64;
+static constexpr uint8_t FUSE_COUNT = TargetConfig::FUSE_COUNT;
+static constexpr uint32_t LOCK_ADDR = TargetConfig::LOCK_BITS_ADDR;
+
+// Offsets into the data space.
+static constexpr uint32_t DEVID_OFFSET = 0x0090;
+static constexpr uint32_t NVM_REGS_SIZE = 0x40;
+static constexpr uint32_t SRAM_OFFSET = TargetConfig::SRAM_START - TargetConfig::RAM_START;
+static constexpr uint32_t SRAM_SIZE = 0x4000;
+
+static uint8_t devid[TargetConfig::DEVID_LEN];
+
+// NVM controller.
+namespace NVMReg {
+  static constexpr uint8_t ADDR0 = 0x00;
+  static constexpr uint8_t DATA0 = 0x04;
+  static constexpr uint8_t DATA1 = 0x05;
+  static constexpr uint8_t DATA2 = 0x06;
+  static constexpr uint8_t CMD = 0x0A;
+  static constexpr uint8_t CTRLA = 0x0B;
+  static constexpr uint8_t STATUS = 0x0F;
+}
+
+namespace NVMCmd {
+  static constexpr uint8_t NOOP                   = 0x00;
+  static constexpr uint8_t CHIPERASE              = 0x40;
+  static constexpr uint8_t READNVM                = 0x43;
+  static constexpr uint8_t LOADFLASHPAGEBUFF      = 0x23;
+  static constexpr uint8_t ERASEFLASHPAGEBUFF     = 0x26;
+  static constexpr uint8_t ERASEFLASHPAGE         = 0x2B;
+  static constexpr uint8_t WRITEFLASHPAGE         = 0x2E;
+  static constexpr uint8_t ERASEWRITEFLASH        = 0x2F;
+  static constexpr uint8_t FLASHCRC               = 0x78;
+  static constexpr uint8_t ERASEAPPSEC            = 0x20;
+  static constexpr uint8_t ERASEAPPSECPAGE        = 0x22;
+  static constexpr uint8_t WRITEAPPSECPAGE        = 0x24;
+  static constexpr uint8_t ERASEWRITEAPPSECPAGE   = 0x25;
+  static constexpr uint8_t APPCRC                 = 0x38;
+  static constexpr uint8_t ERASEBOOTSEC           = 0x68;
+  static constexpr uint8_t ERASEBOOTSECPAGE       = 0x2A;
+  static constexpr uint8_t WRITEBOOTSECPAGE       = 0x2C;
+  static constexpr uint8_t ERASEWRITEBOOTSECPAGE  = 0x2D;
+  static constexpr uint8_t BOOTCRC                = 0x39;
+  static constexpr uint8_t ERASEUSERSIG           = 0x18;
+  static constexpr uint8_t WRITEUSERSIG           = 0x1A;
+  static constexpr uint8_t READFUSE               = 0x07;
+  static constexpr uint8_t WRITEFUSE              = 0x4C;
+  static constexpr uint8_t WRITELOCK              = 0x08;
+  static constexpr uint8_t LOADEEPROMPAGEBUFF     = 0x33;
+  static constexpr uint8_t ERASEEEPROMPAGEBUFF    = 0x36;
+  static constexpr uint8_t ERASEEEPROM            = 0x30;
+  static constexpr uint8_t ERASEEEPROMPAGE        = 0x32;
+  static constexpr uint8_t WRITEEEPROMPAGE        = 0x34;
+  static constexpr uint8_t ERASEWRITEEEPROMPAGE   = 0x35;
+}
+
+// PDI controller.
+enum class Section : uint8_t {
+  ANY,
+  APP,
+  BOOT,
+};
+
+// PDI controller.
+enum class State : uint8_t {
+  DISABLED,
+  IDLE,
+  OPERANDS,
+  ST_DATA,
+  ERROR,
+};
+
+static const uint8_t KEY[8] = { 0xFF, 0x88, 0xD8, 0xCD, 0x45, 0xAB, 0x89, 0x12 };
+
+namespace CSReg {
+  static constexpr uint8_t STATUS = 0;
+  static constexpr uint8_t RESET = 1;
+  static constexpr uint8_t CTRL = 2;
+}
+
+static constexpr uint8_t NVMEN_MASK = 0x02;
+static constexpr uint8_t RESET_SIGNATURE = 0x59;
+
+static uint32_t littleEndian(const uint8_t * const bytes, const uint8_t len) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < len; i++) {
+    value |= ((uint32_t) bytes[i]) << (8 * i);
+  }
+  return value;
+}
+
+static uint8_t addrSize(const uint8_t op) {
+  return ((op >> 2) & 0x3) + 1;
+}
+
+static uint8_t dataSize(const uint8_t op) {
+  return (op & 0x3) + 1;
+}
+
+static uint8_t ptrMode(const uint8_t op) {
+  return (op >> 2) & 0x3;
+}
+
+static uint8_t operandCount(const uint8_t op) {
+  switch (op >> 5) {
+    case 0:  { return addrSize(op); }
+    case 2:  { return addrSize(op) + dataSize(op); }
+    case 5:  { return dataSize(op); }
+    case 6:  { return 1; }
+    case 7:  { return sizeof(KEY); }
+    default: { return 0; }
+  }
+}
+
+// One simulated XMEGA. Every target on the panel has its own memories and NVM
+// and PDI controllers.
+class Target {
+public:
+  // Used to tell targets apart in messages, when there is more than one.
+  uint8_t index;
+
+  uint8_t flash[MAX_FLASH_SIZE];
+  uint8_t eeprom[TargetConfig::MAX_EEPROM_SIZE];
+  uint8_t prodSig[PROD_SIG_SIZE];
+  uint8_t userSig[TargetConfig::MAX_USER_SIG_SIZE];
+  uint8_t fuses[FUSE_COUNT];
+  uint8_t lockBits;
+  uint8_t sram[SRAM_SIZE];
+  bool poweredOn = false;
+
+  uint8_t nvmRegs[NVM_REGS_SIZE];
+  uint8_t flashBuffer[TargetConfig::MAX_FLASH_PAGE_SIZE];
+  bool flashBufferLoaded[TargetConfig::MAX_FLASH_PAGE_SIZE];
+  uint8_t eepromBuffer[TargetConfig::EEPROM_PAGE_SIZE];
+  bool eepromBufferLoaded[TargetConfig::EEPROM_PAGE_SIZE];
+  uint64_t busyUntil = 0;
+
+  State state = State::DISABLED;
+  uint8_t opcode;
+  uint8_t operands[8];
+  uint8_t operandsReceived;
+  uint8_t operandsNeeded;
+  uint32_t repeatCount = 0;
+  uint32_t pointer = 0;
+  uint32_t stRemaining;
+  uint8_t stElement[4];
+  uint8_t stElementLen;
+
+  bool inReset = false;
+  uint8_t guardTimeCode = 0;
+  bool keyAccepted = false;
+  uint64_t nvmEnabledAt;
+
+  // Frames waiting to go to the programmer. A REPEATed LD can produce up to
+  // 65536 x 4 of them.
+  static constexpr uint32_t OUTPUT_SIZE = 1UL << 18;
+  uint8_t output[OUTPUT_SIZE];
+  uint32_t outputHead = 0;
+  uint32_t outputTail = 0;
+
+  // Per-session statistics.
+  struct {
+    uint32_t bytesIn;
+    uint32_t bytesOut;
+    uint32_t instructions;
+    uint32_t pageErases;
+    uint32_t pageWrites;
+    uint32_t breaks;
+    uint32_t warnings;
+    uint64_t busyTime;
+  } stats;
+
+  void label();
+
+  void warn(const char * const format, ...) {
+    va_list args;
+    va_start(args, format);
+    label();
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    stats.warnings++;
+  }
+
+  void powerOn() {
+    memset(flash, 0xFF, sizeof(flash));
+    memset(eeprom, 0xFF, sizeof(eeprom));
+    memset(userSig, 0xFF, sizeof(userSig));
+    memset(fuses, 0xFF, sizeof(fuses));
+    lockBits = 0xFF;
+    for (uint16_t i = 0; i < PROD_SIG_SIZE; i++) {
+      prodSig[i] = i * 0x3B;
+    }
+    memset(sram, 0, sizeof(sram));
+    memset(nvmRegs, 0, sizeof(nvmRegs));
+    memset(flashBuffer, 0xFF, sizeof(flashBuffer));
+    memset(flashBufferLoaded, 0, sizeof(flashBufferLoaded));
+    memset(eepromBuffer, 0xFF, sizeof(eepromBuffer));
+    memset(eepromBufferLoaded, 0, sizeof(eepromBufferLoaded));
+    poweredOn = true;
+  }
+
+  void respond(const uint8_t byte) {
+    if (outputHead - outputTail == OUTPUT_SIZE) {
+      warn("response overflow");
+      return;
+    }
+    output[outputHead % OUTPUT_SIZE] = byte;
+    outputHead++;
+    stats.bytesOut++;
+  }
+
+  // NVM controller
+
+  bool busy(const uint64_t at) {
+    return at < busyUntil;
+  }
+
+  void startOp(const uint64_t at, const uint64_t duration) {
+    busyUntil = at + duration;
+    stats.busyTime += duration;
+  }
+
+  bool nvmEnabled(const uint64_t at) {
+    return keyAccepted && at >= nvmEnabledAt;
+  }
+
+  void clearFlashBuffer() {
+    memset(flashBuffer, 0xFF, sizeof(flashBuffer));
+    memset(flashBufferLoaded, 0, sizeof(flashBufferLoaded));
+  }
+
+  void clearEEPROMBuffer() {
+    memset(eepromBuffer, 0xFF, sizeof(eepromBuffer));
+    memset(eepromBufferLoaded, 0, sizeof(eepromBufferLoaded));
+  }
+
+  // Find the offset into `flash` of the page containing `addr`, which must be
+  // in `section`.
+  bool flashPage(const uint32_t addr, const Section section, uint32_t * const offset) {
+    const uint32_t start = (section == Section::BOOT) ? flashAppSize : 0;
+    const uint32_t end = (section == Section::APP) ? flashAppSize : flashSize;
+    if (addr < TargetConfig::FLASH_START + start || addr >= TargetConfig::FLASH_START + end) {
+      warn("flash page command for %06X outside its section", addr);
+      return false;
+    }
+    const uint32_t flashAddr = addr - TargetConfig::FLASH_START;
+    *offset = flashAddr - flashAddr % flashPageSize;
+    return true;
+  }
+
+  bool eepromPage(const uint32_t addr, uint32_t * const offset) {
+    if (addr < TargetConfig::EEPROM_START || addr >= TargetConfig::EEPROM_START + eepromSize) {
+      warn("EEPROM page command for %06X outside the EEPROM", addr);
+      return false;
+    }
+    const uint32_t eepromAddr = addr - TargetConfig::EEPROM_START;
+    *offset = eepromAddr - eepromAddr % TargetConfig::EEPROM_PAGE_SIZE;
+    return true;
+  }
+
+  void eraseFlashPage(const uint32_t offset) {
+    memset(&flash[offset], 0xFF, flashPageSize);
+    stats.pageErases++;
+  }
+
+  // Programming can only clear bits; unloaded bytes of the buffer are 0xFF.
+  void writeFlashPage(const uint32_t offset) {
+    for (uint16_t i = 0; i < flashPageSize; i++) {
+      flash[offset + i] &= flashBuffer[i];
+    }
+    clearFlashBuffer();
+    stats.pageWrites++;
+  }
+
+  // Only the loaded bytes of an EEPROM page are affected.
+  void eraseEEPROMPage(const uint32_t offset) {
+    for (uint16_t i = 0; i < TargetConfig::EEPROM_PAGE_SIZE; i++) {
+      if (eepromBufferLoaded[i]) { eeprom[offset + i] = 0xFF; }
+    }
+    stats.pageErases++;
+  }
+
+  void writeEEPROMPage(const uint32_t offset) {
+    for (uint16_t i = 0; i < TargetConfig::EEPROM_PAGE_SIZE; i++) {
+      if (eepromBufferLoaded[i]) { eeprom[offset + i] &= eepromBuffer[i]; }
+    }
+    clearEEPROMBuffer();
+    stats.pageWrites++;
+  }
+
+  void crc(const uint32_t start, const uint32_t len, const uint64_t at) {
+    uint32_t result = CRC::CRC24_INIT;
+    for (uint32_t i = start; i < start + len; i += 2) {
+      result = CRC::update24(result, flash[i] | (((uint16_t) flash[i + 1]) << 8));
+    }
+    nvmRegs[NVMReg::DATA0] = result;
+    nvmRegs[NVMReg::DATA1] = result >> 8;
+    nvmRegs[NVMReg::DATA2] = result >> 16;
+    startOp(at, len * CRC_TIME_PER_BYTE);
+  }
+
+  // Commands triggered by setting CMDEX.
+  void execute(const uint64_t at) {
+    const uint8_t cmd = nvmRegs[NVMReg::CMD];
+    if (busy(at)) {
+      warn("CMDEX for command %02X while busy", cmd);
+      return;
+    }
+
+    switch (cmd) {
+      case NVMCmd::NOOP: {
+        break;
+      }
+      case NVMCmd::CHIPERASE: {
+        memset(flash, 0xFF, sizeof(flash));
+        memset(eeprom, 0xFF, sizeof(eeprom));
+        lockBits = 0xFF;
+        startOp(at, CHIP_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::ERASEFLASHPAGEBUFF: {
+        clearFlashBuffer();
+        break;
+      }
+      case NVMCmd::ERASEEEPROMPAGEBUFF: {
+        clearEEPROMBuffer();
+        break;
+      }
+      case NVMCmd::ERASEEEPROM: {
+        memset(eeprom, 0xFF, sizeof(eeprom));
+        startOp(at, SECTION_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::FLASHCRC: {
+        crc(0, flashSize, at);
+        break;
+      }
+      case NVMCmd::READFUSE: {
+        const uint8_t index = nvmRegs[NVMReg::ADDR0];
+        nvmRegs[NVMReg::DATA0] = (index < FUSE_COUNT) ? fuses[index] : 0xFF;
+        break;
+      }
+      default: {
+        warn("CMDEX for unsupported command %02X", cmd);
+        break;
+      }
+    }
+  }
+
+  // Commands triggered by a write to the NVM address space.
+  void nvmWrite(const uint32_t addr, const uint8_t data, const uint64_t at) {
+    const uint8_t cmd = nvmRegs[NVMReg::CMD];
+    if (busy(at)) {
+      warn("write to %06X for command %02X while busy", addr, cmd);
+      return;
+    }
+
+    uint32_t offset;
+    switch (cmd) {
+      case NVMCmd::LOADFLASHPAGEBUFF: {
+        if (addr < TargetConfig::FLASH_START || addr >= TargetConfig::FLASH_START + flashSize) {
+          warn("flash page buffer load for %06X outside the flash", addr);
+          break;
+        }
+        const uint16_t i = (addr - TargetConfig::FLASH_START) % flashPageSize;
+        if (flashBufferLoaded[i]) {
+          warn("flash page buffer byte %03X loaded twice", i);
+        }
+        flashBuffer[i] &= data;
+        flashBufferLoaded[i] = true;
+        break;
+      }
+      case NVMCmd::LOADEEPROMPAGEBUFF: {
+        if (addr < TargetConfig::EEPROM_START || addr >= TargetConfig::EEPROM_START + eepromSize) {
+          warn("EEPROM page buffer load for %06X outside the EEPROM", addr);
+          break;
+        }
+        const uint16_t i = (addr - TargetConfig::EEPROM_START) % TargetConfig::EEPROM_PAGE_SIZE;
+        if (eepromBufferLoaded[i]) {
+          warn("EEPROM page buffer byte %02X loaded twice", i);
+        }
+        eepromBuffer[i] &= data;
+        eepromBufferLoaded[i] = true;
+        break;
+      }
+
+      case NVMCmd::ERASEFLASHPAGE:
+      case NVMCmd::ERASEAPPSECPAGE:
+      case NVMCmd::ERASEBOOTSECPAGE: {
+        const Section section = (cmd == NVMCmd::ERASEAPPSECPAGE) ? Section::APP :
+                                (cmd == NVMCmd::ERASEBOOTSECPAGE) ? Section::BOOT : Section::ANY;
+        if (!flashPage(addr, section, &offset)) { break; }
+        eraseFlashPage(offset);
+        startOp(at, PAGE_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::WRITEFLASHPAGE:
+      case NVMCmd::WRITEAPPSECPAGE:
+      case NVMCmd::WRITEBOOTSECPAGE: {
+        const Section section = (cmd == NVMCmd::WRITEAPPSECPAGE) ? Section::APP :
+                                (cmd == NVMCmd::WRITEBOOTSECPAGE) ? Section::BOOT : Section::ANY;
+        if (!flashPage(addr, section, &offset)) { break; }
+        writeFlashPage(offset);
+        startOp(at, PAGE_WRITE_TIME);
+        break;
+      }
+      case NVMCmd::ERASEWRITEFLASH:
+      case NVMCmd::ERASEWRITEAPPSECPAGE:
+      case NVMCmd::ERASEWRITEBOOTSECPAGE: {
+        const Section section = (cmd == NVMCmd::ERASEWRITEAPPSECPAGE) ? Section::APP :
+                                (cmd == NVMCmd::ERASEWRITEBOOTSECPAGE) ? Section::BOOT : Section::ANY;
+        if (!flashPage(addr, section, &offset)) { break; }
+        eraseFlashPage(offset);
+        writeFlashPage(offset);
+        startOp(at, PAGE_ERASE_WRITE_TIME);
+        break;
+      }
+
+      case NVMCmd::ERASEAPPSEC: {
+        memset(flash, 0xFF, flashAppSize);
+        startOp(at, SECTION_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::ERASEBOOTSEC: {
+        memset(&flash[flashAppSize], 0xFF, flashSize - flashAppSize);
+        startOp(at, SECTION_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::APPCRC: {
+        crc(0, flashAppSize, at);
+        break;
+      }
+      case NVMCmd::BOOTCRC: {
+        crc(flashAppSize, flashSize - flashAppSize, at);
+        break;
+      }
+
+      case NVMCmd::ERASEUSERSIG: {
+        memset(userSig, 0xFF, sizeof(userSig));
+        stats.pageErases++;
+        startOp(at, PAGE_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::WRITEUSERSIG: {
+        for (uint16_t i = 0; i < userSigSize; i++) {
+          userSig[i] &= flashBuffer[i];
+        }
+        clearFlashBuffer();
+        stats.pageWrites++;
+        startOp(at, PAGE_WRITE_TIME);
+        break;
+      }
+
+      case NVMCmd::ERASEEEPROMPAGE: {
+        if (!eepromPage(addr, &offset)) { break; }
+        eraseEEPROMPage(offset);
+        startOp(at, PAGE_ERASE_TIME);
+        break;
+      }
+      case NVMCmd::WRITEEEPROMPAGE: {
+        if (!eepromPage(addr, &offset)) { break; }
+        writeEEPROMPage(offset);
+        startOp(at, PAGE_WRITE_TIME);
+        break;
+      }
+      case NVMCmd::ERASEWRITEEEPROMPAGE: {
+        if (!eepromPage(addr, &offset)) { break; }
+        eraseEEPROMPage(offset);
+        writeEEPROMPage(offset);
+        startOp(at, PAGE_ERASE_WRITE_TIME);
+        break;
+      }
+
+      case NVMCmd::WRITEFUSE: {
+        if (addr < TargetConfig::FUSE_START || addr >= TargetConfig::FUSE_START + FUSE_COUNT) {
+          warn("fuse write to %06X outside the fuses", addr);
+          break;
+        }
+        fuses[addr - TargetConfig::FUSE_START] = data;
+        startOp(at, FUSE_WRITE_TIME);
+        break;
+      }
+      case NVMCmd::WRITELOCK: {
+        if (addr != LOCK_ADDR) {
+          warn("lock bits write to %06X", addr);
+          break;
+        }
+        // Lock bits can only be cleared, other than by a chip erase.
+        lockBits &= data;
+        startOp(at, FUSE_WRITE_TIME);
+        break;
+      }
+
+      default: {
+        warn("write to %06X for unsupported command %02X", addr, cmd);
+        break;
+      }
+    }
+  }
+
+  // The byte at `addr` in the NVM address space, or nullptr if there is none.
+  uint8_t * nvmByte(const uint32_t addr) {
+    struct Region {
+      uint32_t start;
+      uint32_t size;
+      uint8_t * data;
+    };
+    const Region regions[] = {
+      { TargetConfig::FLASH_START, flashSize, flash },
+      { TargetConfig::EEPROM_START, eepromSize, eeprom },
+      { PROD_SIG_START, PROD_SIG_SIZE, prodSig },
+      { TargetConfig::USER_SIG_START, userSigSize, userSig },
+      { TargetConfig::FUSE_START, FUSE_COUNT, fuses },
+      { LOCK_ADDR, 1, &lockBits },
+    };
+    for (const Region & region : regions) {
+      if (addr >= region.start && addr - region.start < region.size) {
+        return &region.data[addr - region.start];
+      }
+    }
+    return nullptr;
+  }
+
+  // The PDI bus
+
+  uint8_t busRead(const uint32_t addr, const uint64_t at) {
+    if (addr >= TargetConfig::RAM_START) {
+      const uint32_t offset = addr - TargetConfig::RAM_START;
+      if (offset - TargetConfig::NVM_REGS_OFFSET < NVM_REGS_SIZE) {
+        const uint8_t reg = offset - TargetConfig::NVM_REGS_OFFSET;
+        if (reg == NVMReg::STATUS) {
+          static constexpr uint8_t BUSY = 0x80;
+          static constexpr uint8_t FBUSY = 0x40;
+          static constexpr uint8_t EELOAD = 0x02;
+          static constexpr uint8_t FLOAD = 0x01;
+          uint8_t status = busy(at) ? (BUSY | FBUSY) : 0;
+          for (uint16_t i = 0; i < flashPageSize; i++) {
+            if (flashBufferLoaded[i]) { status |= FLOAD; break; }
+          }
+          for (uint16_t i = 0; i < TargetConfig::EEPROM_PAGE_SIZE; i++) {
+            if (eepromBufferLoaded[i]) { status |= EELOAD; break; }
+          }
+          return status;
+        }
+        return nvmRegs[reg];
+      }
+      if (offset - DEVID_OFFSET < sizeof(devid)) {
+        return devid[offset - DEVID_OFFSET];
+      }
+      if (offset - SRAM_OFFSET < SRAM_SIZE) {
+        return sram[offset - SRAM_OFFSET];
+      }
+      warn("read from unmapped data space address %04X", offset);
+      return 0;
+    }
+
+    if (!nvmEnabled(at)) {
+      warn("read from %06X with the NVM interface disabled", addr);
+      return 0;
+    }
+    if (busy(at)) {
+      warn("read from %06X while busy", addr);
+      return 0xFF;
+    }
+    if (nvmRegs[NVMReg::CMD] != NVMCmd::READNVM) {
+      warn("read from %06X for command %02X", addr, nvmRegs[NVMReg::CMD]);
+      return 0;
+    }
+    const uint8_t * const byte = nvmByte(addr);
+    if (!byte) {
+      warn("read from unmapped NVM address %06X", addr);
+      return 0;
+    }
+    return *byte;
+  }
+
+  void busWrite(const uint32_t addr, const uint8_t data, const uint64_t at) {
+    if (addr >= TargetConfig::RAM_START) {
+      const uint32_t offset = addr - TargetConfig::RAM_START;
+      if (offset - TargetConfig::NVM_REGS_OFFSET < NVM_REGS_SIZE) {
+        const uint8_t reg = offset - TargetConfig::NVM_REGS_OFFSET;
+        if (reg == NVMReg::CTRLA) {
+          static constexpr uint8_t CMDEX = 0x01;
+          if (data & CMDEX) { execute(at); }
+        } else if (reg == NVMReg::CMD && busy(at)) {
+          warn("CMD changed to %02X while busy", data);
+        } else if (reg != NVMReg::STATUS) {
+          nvmRegs[reg] = data;
+        }
+        return;
+      }
+      if (offset - SRAM_OFFSET < SRAM_SIZE) {
+        sram[offset - SRAM_OFFSET] = data;
+        return;
+      }
+      warn("write to unmapped data space address %04X", offset);
+      return;
+    }
+
+    if (!nvmEnabled(at)) {
+      warn("write to %06X with the NVM interface disabled", addr);
+      return;
+    }
+    nvmWrite(addr, data, at);
+  }
+
+  // The PDI controller
+
+  void ld(const uint64_t at) {
+    const uint8_t size = dataSize(opcode);
+    const uint8_t pm = ptrMode(opcode);
+    const uint32_t count = repeatCount + 1;
+    repeatCount = 0;
+
+    for (uint32_t n = 0; n < count; n++) {
+      switch (pm) {
+        case 0:
+        case 1: {
+          for (uint8_t i = 0; i < size; i++) {
+            respond(busRead(pointer + i, at));
+          }
+          if (pm == 1) { pointer += size; }
+          break;
+        }
+        case 2: {
+          for (uint8_t i = 0; i < size; i++) {
+            respond(pointer >> (8 * i));
+          }
+          break;
+        }
+        default: {
+          warn("LD with reserved pointer mode");
+          respond(0);
+          break;
+        }
+      }
+    }
+  }
+
+  void stElementReceived(const uint64_t at) {
+    const uint8_t size = dataSize(opcode);
+    const uint8_t pm = ptrMode(opcode);
+    switch (pm) {
+      case 0:
+      case 1: {
+        for (uint8_t i = 0; i < size; i++) {
+          busWrite(pointer + i, stElement[i], at);
+        }
+        if (pm == 1) { pointer += size; }
+        break;
+      }
+      case 2: {
+        // Only the bytes given are replaced.
+        const uint32_t mask = (size == 4) ? 0xFFFFFFFF : ((1UL << (8 * size)) - 1);
+        pointer = (pointer & ~mask) | littleEndian(stElement, size);
+        break;
+      }
+      default: {
+        warn("ST with reserved pointer mode");
+        break;
+      }
+    }
+  }
+
+  // Execute the instruction in `opcode` once all of its operands are in.
+  void instruction(const uint64_t at) {
+    stats.instructions++;
+    state = State::IDLE;
+
+    switch (opcode >> 5) {
+      case 0: {
+        // LDS
+        const uint32_t addr = littleEndian(operands, addrSize(opcode));
+        for (uint8_t i = 0; i < dataSize(opcode); i++) {
+          respond(busRead(addr + i, at));
+        }
+        repeatCount = 0;
+        break;
+      }
+      case 1: {
+        ld(at);
+        break;
+      }
+      case 2: {
+        // STS
+        const uint8_t as = addrSize(opcode);
+        const uint32_t addr = littleEndian(operands, as);
+        for (uint8_t i = 0; i < dataSize(opcode); i++) {
+          busWrite(addr + i, operands[as + i], at);
+        }
+        repeatCount = 0;
+        break;
+      }
+      case 3: {
+        // ST: the data follows, one element per repetition.
+        stRemaining = repeatCount + 1;
+        stElementLen = 0;
+        repeatCount = 0;
+        state = State::ST_DATA;
+        break;
+      }
+      case 4: {
+        // LDCS
+        const uint8_t reg = opcode & 0xF;
+        switch (reg) {
+          case CSReg::STATUS: { respond(nvmEnabled(at) ? NVMEN_MASK : 0); break; }
+          case CSReg::RESET:  { respond(inReset ? 0x01 : 0x00); break; }
+          case CSReg::CTRL:   { respond(guardTimeCode); break; }
+          default: {
+            warn("LDCS from reserved register %u", reg);
+            respond(0);
+            break;
+          }
+        }
+        repeatCount = 0;
+        break;
+      }
+      case 5: {
+        // REPEAT
+        repeatCount = littleEndian(operands, dataSize(opcode));
+        break;
+      }
+      case 6: {
+        // STCS
+        const uint8_t reg = opcode & 0xF;
+        const uint8_t data = operands[0];
+        switch (reg) {
+          case CSReg::STATUS: {
+            if (!(data & NVMEN_MASK)) { keyAccepted = false; }
+            break;
+          }
+          case CSReg::RESET: { inReset = (data == RESET_SIGNATURE); break; }
+          case CSReg::CTRL:  { guardTimeCode = data & 0x7; break; }
+          default: {
+            warn("STCS to reserved register %u", reg);
+            break;
+          }
+        }
+        repeatCount = 0;
+        break;
+      }
+      case 7: {
+        // KEY
+        if (memcmp(operands, KEY, sizeof(KEY)) == 0) {
+          if (!keyAccepted) {
+            keyAccepted = true;
+            nvmEnabledAt = at + NVMEN_DELAY;
+          }
+        } else {
+          warn("wrong NVM key");
+        }
+        repeatCount = 0;
+        break;
+      }
+    }
+  }
+
+  void enable() {
+    if (!poweredOn) { powerOn(); }
+    memset(&stats, 0, sizeof(stats));
+    state = State::IDLE;
+    repeatCount = 0;
+    pointer = 0;
+    inReset = false;
+    guardTimeCode = 0;
+    keyAccepted = false;
+    outputHead = outputTail = 0;
+  }
+
+  void disable() {
+    if (state == State::DISABLED) { return; }
+    state = State::DISABLED;
+    inReset = false;
+    keyAccepted = false;
+    outputHead = outputTail = 0;
+    label();
+    fprintf(stderr,
+      "session: %u instructions, %u bytes in, %u bytes out, %u breaks, "
+      "%u page erases, %u page writes, %.1f ms busy, %u warnings\n",
+      stats.instructions, stats.bytesIn, stats.bytesOut, stats.breaks,
+      stats.pageErases, stats.pageWrites, stats.busyTime / 1e6, stats.warnings);
+  }
+
+  void sendBreak() {
+    if (state == State::DISABLED) { return; }
+    stats.breaks++;
+    state = State::IDLE;
+    repeatCount = 0;
+    outputHead = outputTail = 0;
+  }
+
+  void receive(const uint8_t byte, const uint64_t at) {
+    if (state == State::DISABLED || state == State::ERROR) { return; }
+    stats.bytesIn++;
+
+    switch (state) {
+      case State::IDLE: {
+        opcode = byte;
+        operandsReceived = 0;
+        operandsNeeded = operandCount(opcode);
+        if (operandsNeeded) {
+          state = State::OPERANDS;
+        } else {
+          instruction(at);
+        }
+        break;
+      }
+      case State::OPERANDS: {
+        operands[operandsReceived++] = byte;
+        if (operandsReceived == operandsNeeded) {
+          instruction(at);
+        }
+        break;
+      }
+      case State::ST_DATA: {
+        stElement[stElementLen++] = byte;
+        if (stElementLen == dataSize(opcode)) {
+          stElementReceived(at);
+          stElementLen = 0;
+          if (--stRemaining == 0) {
+            state = State::IDLE;
+          }
+        }
+        break;
+      }
+      default: {
+        break;
+      }
+    }
+  }
+
+  void receiveError() {
+    if (state == State::DISABLED || state == State::ERROR) { return; }
+    // The PDI ignores everything until it gets a BREAK.
+    state = State::ERROR;
+    outputHead = outputTail = 0;
+  }
+
+  bool transmit(uint8_t * const byte) {
+    if (outputHead == outputTail) { return false; }
+    *byte = output[outputTail % OUTPUT_SIZE];
+    outputTail++;
+    return true;
+  }
+
+  uint8_t guardCycles() {
+    return (guardTimeCode < 7) ? (128 >> guardTimeCode) : 2;
+  }
+};
+
+static Target targets[SimTarget::MAX_TARGETS];
+static uint8_t targetCount = 1;
+static Target * selected = &targets[0];
+
+void Target::label() {
+  if (targetCount > 1) {
+    fprintf(stderr, "sim: target %u: ", index);
+  } else {
+    fprintf(stderr, "sim: ");
+  }
+}
+
+static const TargetConfig::Device * findDevice(const uint16_t id) {
+  for (const TargetConfig::Device & device : TargetConfig::DEVICES) {
+    if (device.id == id) { return &device; }
+  }
+  return nullptr;
+}
+
+void SimTarget::init(const uint8_t count, const uint32_t signature) {
+  devid[0] = signature >> 16;
+  devid[1] = signature >> 8;
+  devid[2] = signature;
+
+  // A device missing from the table is given the memories of the default one,
+  // for trying out how the programmer takes to it.
+  const TargetConfig::Device * device = findDevice(signature & 0xFFFF);
+  if (!device) {
+    device = findDevice(DEFAULT_SIGNATURE & 0xFFFF);
+  }
+  flashAppSize = device->appSize();
+  flashSize = device->appSize() + device->bootSize();
+  flashPageSize = device->flashPageSize();
+  eepromSize = device->eepromSize;
+  userSigSize = device->userSigSize();
+
+  targetCount = (count < 1) ? 1 : (count > MAX_TARGETS) ? MAX_TARGETS : count;
+  for (uint8_t i = 0; i < MAX_TARGETS; i++) {
+    targets[i].index = i;
+  }
+  selected = &targets[0];
+}
+
+uint8_t SimTarget::count() {
+  return targetCount;
+}
+
+void SimTarget::select(const uint8_t target) {
+  selected = &targets[target];
+}
+
+void SimTarget::enable() {
+  for (uint8_t i = 0; i < targetCount; i++) {
+    targets[i].enable();
+  }
+}
+
+void SimTarget::disable() {
+  for (uint8_t i = 0; i < targetCount; i++) {
+    targets[i].disable();
+  }
+}
+
+void SimTarget::sendBreak() {
+  selected->sendBreak();
+}
+
+void SimTarget::receive(const uint8_t byte, const uint64_t at) {
+  selected->receive(byte, at);
+}
+
+void SimTarget::receiveError() {
+  selected->receiveError();
+}
+
+bool SimTarget::transmit(uint8_t * const byte) {
+  return selected->transmit(byte);
+}
+
+uint8_t SimTarget::guardCycles() {
+  return selected->guardCycles();
+}
@@ -0,0 +1,43 @@
+#ifndef __PDIPROG_SIM_TARGET_HPP
+#define __PDIPROG_SIM_TARGET_HPP
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A simulated XMEGA, as seen through its PDI pins. It has the memory map, NVM
+// controller and page buffers described by TargetConfig for the device it is
+// set up as, and takes about as long as the real thing over each NVM
+// operation. Times are in nanoseconds.
+//
+// There may be several targets, as on a panel. They share the PDI clock, and
+// the programmer switches its data line between them.
+namespace SimTarget {
+  static constexpr uint8_t MAX_TARGETS = 4;
+  // ATxmega192A3.
+  static constexpr uint32_t DEFAULT_SIGNATURE = 0x1E9744;
+
+  // Every target is the device with MCU.DEVID0-2 `signature`.
+  void init(const uint8_t count, const uint32_t signature);
+  uint8_t count();
+  // Connect the data line to `target`. Everything below, apart from the clock,
+  // concerns only the selected target.
+  void select(const uint8_t target);
+
+  // The programmer has started or stopped the PDI clock.
+  void enable();
+  void disable();
+  // The data line has been held low for a BREAK.
+  void sendBreak();
+
+  // A frame from the programmer, complete at `at`.
+  void receive(const uint8_t byte, const uint64_t at);
+  // A frame that arrived with a parity or framing error.
+  void receiveError();
+  // Take the next frame for the programmer. Returns false if there is none.
+  bool transmit(uint8_t * const byte);
+
+  // Idle clock cycles the target inserts before responding.
+  uint8_t guardCycles();
+}
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef __PDIPROG_SIM_AVR_PGMSPACE_H
+#define __PDIPROG_SIM_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+// There is only one address space on the host.
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t *) (addr))
+#define pgm_read_word(addr) (*(const uint16_t *) (addr))
+
+#endif
@@ -0,0 +1,8 @@
+#ifndef __PDIPROG_SIM_UTIL_DELAY_H
+#define __PDIPROG_SIM_UTIL_DELAY_H
+
+// Real-time delays, implemented in Platform.cpp.
+void _delay_us(double us);
+void _delay_ms(double ms);
+
+#endif
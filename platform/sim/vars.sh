@@ -0,0 +1,4 @@
+TOOLCHAIN_PREFIX=
+CC_FLAGS="${CC_FLAGS:-} -DF_CPU=12000000"
+# One channel per simulated target (SimTarget::MAX_TARGETS).
+CC_FLAGS="${CC_FLAGS:-} -DPDIPROG_CHANNELS=4"
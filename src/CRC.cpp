@@ -0,0 +1,27 @@
+#include <stdint.h>
+
+#include "CRC.hpp"
+
+uint16_t CRC::update16(const uint16_t crc, const uint8_t byte) {
+  static constexpr uint16_t POLY = 0x1021;
+
+  uint16_t result = crc ^ (((uint16_t) byte) << 8);
+  for (uint8_t i = 0; i < 8; i++) {
+    if (result & 0x8000) {
+      result = (result << 1) ^ POLY;
+    } else {
+      result = result << 1;
+    }
+  }
+  return result;
+}
+
+uint32_t CRC::update24(const uint32_t crc, const uint16_t word) {
+  static constexpr uint32_t POLY = 0x80001B;
+
+  uint32_t result = crc << 1;
+  if (result & 0x01000000) {
+    result ^= POLY;
+  }
+  return (result ^ word) & 0x00FFFFFF;
+}
@@ -0,0 +1,21 @@
+#ifndef __PDIPROG_CRC_HPP
+#define __PDIPROG_CRC_HPP
+
+#include <stdint.h>
+
+namespace CRC {
+  // CRC-16/CCITT-FALSE (polynomial 0x1021, MSB first). This is the same CRC as
+  // Python's binascii.crc_hqx(data, CRC16_INIT).
+  static constexpr uint16_t CRC16_INIT = 0xFFFF;
+
+  uint16_t update16(const uint16_t crc, const uint8_t byte);
+
+  // The 24-bit CRC computed by the XMEGA NVM controller's APPCRC, BOOTCRC and
+  // FLASHCRC commands. Flash is fed in little-endian 16-bit words, starting
+  // from CRC24_INIT.
+  static constexpr uint32_t CRC24_INIT = 0;
+
+  uint32_t update24(const uint32_t crc, const uint16_t word);
+}
+
+#endif
@@ -0,0 +1,322 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <util/delay.h>
+
+#include "CRC.hpp"
+#include "Client.hpp"
+#include "Platform.hpp"
+
+static_assert((Client::WINDOW_SIZE & (Client::WINDOW_SIZE - 1)) == 0, "WINDOW_SIZE must be a power of two");
+static_assert(Client::WINDOW_SIZE <= 8, "slot bitmask is 8 bits wide");
+
+// Receive window. Slot `seq % WINDOW_SIZE` holds frame `seq`.
+static uint8_t slots[Client::WINDOW_SIZE][Client::BLOCK_SIZE];
+static uint8_t slotLens[Client::WINDOW_SIZE];
+static uint8_t slotsFull = 0;
+static uint8_t rxBase = 0;
+static uint8_t rxPos = 0;
+
+// State of the frame currently being parsed.
+enum class RxState : uint8_t {
+  HUNT,
+  SEQ,
+  LEN,
+  PAYLOAD,
+  CRC_LO,
+  CRC_HI,
+};
+
+static RxState rxState = RxState::HUNT;
+static uint8_t syncCount = 0;
+static uint8_t frameSeq;
+static uint8_t frameLen;
+static uint8_t framePos;
+static uint16_t frameCrc;
+static uint8_t frameCrcLo;
+static uint8_t * frameSlot;
+
+// Partially filled outgoing frame.
+static uint8_t txBlock[Client::BLOCK_SIZE];
+static uint8_t txLen = 0;
+static uint8_t txSeq = 0;
+
+static bool requestAborted = false;
+static bool synced = false;
+
+static uint8_t slotMask(const uint8_t seq) {
+  return 1 << (seq & (Client::WINDOW_SIZE - 1));
+}
+
+static void rawSend(const uint8_t data) {
+  while (!Platform::ClientSerial::tryWrite(data)) {}
+}
+
+static void sendReply(const uint8_t type, const uint8_t seq) {
+  rawSend(type);
+  rawSend(seq);
+  rawSend(rxBase);
+  rawSend(~(seq ^ rxBase));
+}
+
+static void reset() {
+  slotsFull = 0;
+  rxBase = 0;
+  rxPos = 0;
+  rxState = RxState::HUNT;
+  syncCount = 0;
+  txLen = 0;
+  txSeq = 0;
+}
+
+static void resync() {
+  reset();
+  requestAborted = true;
+  synced = true;
+  rawSend(Client::Frame::SYNC_REPLY);
+}
+
+// A complete frame has been received; file it into the receive window.
+static void frameReceived(const uint16_t crc) {
+  using namespace Client;
+
+  // Frames in [rxBase, rxBase + WINDOW_SIZE) are stored unless we already have
+  // them. Frames before rxBase are retransmissions of frames whose ACK was
+  // lost.
+  const uint8_t offset = frameSeq - rxBase;
+  const bool inWindow = offset < WINDOW_SIZE;
+  const bool duplicate = offset >= 0x80;
+
+  if (crc != frameCrc) {
+    if (inWindow) {
+      sendReply(Frame::NAK, frameSeq);
+    }
+    return;
+  }
+  const uint8_t mask = slotMask(frameSeq);
+  if (frameSlot) {
+    slotsFull |= mask;
+    slotLens[frameSeq & (WINDOW_SIZE - 1)] = frameLen;
+  }
+  // The window may have moved while the frame was arriving, so only ACK it if
+  // it is actually held.
+  if ((inWindow && (slotsFull & mask)) || duplicate) {
+    sendReply(Frame::ACK, frameSeq);
+  }
+}
+
+static void processByte(const uint8_t byte) {
+  using namespace Client;
+
+  switch (rxState) {
+    case RxState::HUNT: {
+      if (byte == Frame::DATA) {
+        syncCount = 0;
+        rxState = RxState::SEQ;
+      } else if (byte == Frame::SYNC) {
+        syncCount++;
+        if (syncCount == Frame::SYNC_LEN) {
+          resync();
+        }
+      } else {
+        syncCount = 0;
+      }
+      break;
+    }
+    case RxState::SEQ: {
+      frameSeq = byte;
+      rxState = RxState::LEN;
+      break;
+    }
+    case RxState::LEN: {
+      if (byte == 0 || byte > BLOCK_SIZE) {
+        // Not a valid header; go back to hunting.
+        rxState = RxState::HUNT;
+        break;
+      }
+      frameLen = byte;
+      framePos = 0;
+      frameCrc = CRC::update16(CRC::update16(CRC::CRC16_INIT, frameSeq), frameLen);
+      const uint8_t offset = frameSeq - rxBase;
+      const bool inWindow = offset < WINDOW_SIZE;
+      frameSlot = (inWindow && !(slotsFull & slotMask(frameSeq))) ? slots[frameSeq & (WINDOW_SIZE - 1)] : nullptr;
+      rxState = RxState::PAYLOAD;
+      break;
+    }
+    case RxState::PAYLOAD: {
+      frameCrc = CRC::update16(frameCrc, byte);
+      if (frameSlot) {
+        frameSlot[framePos] = byte;
+      }
+      framePos++;
+      if (framePos == frameLen) {
+        rxState = RxState::CRC_LO;
+      }
+      break;
+    }
+    case RxState::CRC_LO: {
+      frameCrcLo = byte;
+      rxState = RxState::CRC_HI;
+      break;
+    }
+    case RxState::CRC_HI: {
+      rxState = RxState::HUNT;
+      frameReceived(frameCrcLo | (((uint16_t) byte) << 8));
+      break;
+    }
+  }
+}
+
+void Client::init() {
+  reset();
+  requestAborted = false;
+  Platform::ClientSerial::init(DEFAULT_BAUD);
+}
+
+void Client::poll() {
+  // Stop at the end of a frame so that a continuous stream from the host
+  // cannot keep us here indefinitely.
+  uint8_t byte;
+  while (Platform::ClientSerial::tryRead(&byte)) {
+    processByte(byte);
+    if (rxState == RxState::HUNT) {
+      break;
+    }
+  }
+}
+
+static uint8_t consume() {
+  const uint8_t index = rxBase & (Client::WINDOW_SIZE - 1);
+  const uint8_t data = slots[index][rxPos];
+  rxPos++;
+  if (rxPos == slotLens[index]) {
+    // Frame fully consumed; free the slot and tell the host the window moved.
+    slotsFull &= ~slotMask(rxBase);
+    rxPos = 0;
+    rxBase++;
+    sendReply(Client::Frame::ACK, rxBase - 1);
+  }
+  return data;
+}
+
+uint8_t Client::recv() {
+  const uint8_t mask = slotMask(rxBase);
+  while (!(slotsFull & mask) && !requestAborted) {
+    Client::poll();
+  }
+  if (requestAborted) {
+    return 0xFF;
+  }
+  return consume();
+}
+
+bool Client::tryRecv(uint8_t * const data) {
+  if (!(slotsFull & slotMask(rxBase)) && !requestAborted) {
+    Client::poll();
+    if (!(slotsFull & slotMask(rxBase)) && !requestAborted) {
+      return false;
+    }
+  }
+  *data = requestAborted ? 0xFF : consume();
+  return true;
+}
+
+uint16_t Client::recv2() {
+  union {
+    uint8_t bytes[2];
+    uint16_t word;
+  } u;
+  for (uint8_t i = 0; i < 2; i++) {
+    u.bytes[i] = Client::recv();
+  }
+  return u.word;
+}
+
+uint32_t Client::recv4() {
+  union {
+    uint8_t bytes[4];
+    uint32_t word;
+  } u;
+  for (uint8_t i = 0; i < 4; i++) {
+    u.bytes[i] = Client::recv();
+  }
+  return u.word;
+}
+
+void Client::send(const uint8_t data) {
+  if (requestAborted) {
+    return;
+  }
+  txBlock[txLen] = data;
+  txLen++;
+  if (txLen == BLOCK_SIZE) {
+    Client::flush();
+  }
+}
+
+void Client::send2(const uint16_t word) {
+  const uint8_t * const bytes = (const uint8_t *) &word;
+  Client::send(bytes[0]);
+  Client::send(bytes[1]);
+}
+
+void Client::send4(const uint32_t word) {
+  const uint8_t * const bytes = (const uint8_t *) &word;
+  Client::send(bytes[0]);
+  Client::send(bytes[1]);
+  Client::send(bytes[2]);
+  Client::send(bytes[3]);
+}
+
+void Client::flush() {
+  if (txLen == 0) {
+    return;
+  }
+
+  uint16_t crc = CRC::CRC16_INIT;
+  crc = CRC::update16(crc, txSeq);
+  crc = CRC::update16(crc, txLen);
+
+  rawSend(Frame::DATA);
+  rawSend(txSeq);
+  rawSend(txLen);
+  for (uint8_t i = 0; i < txLen; i++) {
+    rawSend(txBlock[i]);
+    crc = CRC::update16(crc, txBlock[i]);
+  }
+  rawSend(crc & 0xFF);
+  rawSend(crc >> 8);
+
+  txSeq++;
+  txLen = 0;
+}
+
+bool Client::setBaudRate(const uint32_t baud) {
+  Client::flush();
+  const uint32_t oldBaud = Platform::ClientSerial::baudRate();
+  Platform::ClientSerial::setBaudRate(baud);
+
+  synced = false;
+  for (uint16_t i = 0; i < BAUD_HANDSHAKE_TIMEOUT_MS * 10 && !synced; i++) {
+    Client::poll();
+    _delay_us(100);
+  }
+  if (!synced) {
+    Platform::ClientSerial::setBaudRate(oldBaud);
+  }
+  return synced;
+}
+
+void Client::resetBaudRate() {
+  Client::flush();
+  Platform::ClientSerial::setBaudRate(DEFAULT_BAUD);
+}
+
+bool Client::aborted() {
+  return requestAborted;
+}
+
+void Client::endRequest() {
+  Client::flush();
+  requestAborted = false;
+}
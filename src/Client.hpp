@@ -0,0 +1,81 @@
+#ifndef __PDIPROG_CLIENT_HPP
+#define __PDIPROG_CLIENT_HPP
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Block-framed link to the host.
+//
+// The host->programmer byte stream is carried in DATA frames:
+//
+//   DATA seq len payload[len] crc16
+//
+// where crc16 (little-endian) covers seq, len and the payload. The host may
+// have up to WINDOW_SIZE frames in flight. Every frame that arrives intact is
+// acknowledged individually, so only corrupted or lost frames need to be
+// retransmitted:
+//
+//   ACK seq base check
+//   NAK seq base check
+//
+// `base` is the sequence number of the oldest frame not yet consumed by the
+// programmer; the host may send any frame in [base, base + WINDOW_SIZE).
+// `check` is the bitwise complement of (seq ^ base).
+//
+// The programmer->host stream is carried in DATA frames of the same format,
+// which the host checks but does not acknowledge.
+//
+// Sending SYNC_LEN consecutive SYNC bytes outside of a frame resets the link.
+// The programmer responds with a single raw SYNC_REPLY byte. A reset abandons
+// any request in progress, but leaves the baud rate alone, so a reset whose
+// reply was lost can simply be repeated.
+namespace Client {
+  static constexpr uint8_t BLOCK_SIZE = 64;
+  static constexpr uint8_t WINDOW_SIZE = 4;
+  static constexpr uint32_t DEFAULT_BAUD = 57600;
+  static constexpr uint16_t BAUD_HANDSHAKE_TIMEOUT_MS = 1000;
+
+  namespace Frame {
+    static constexpr uint8_t DATA = 0xD0;
+    static constexpr uint8_t ACK = 0xA0;
+    static constexpr uint8_t NAK = 0xB0;
+    static constexpr uint8_t SYNC = 0x59;
+    static constexpr uint8_t SYNC_REPLY = 0xA6;
+    static constexpr uint8_t SYNC_LEN = 4;
+  }
+
+  void init();
+
+  // Process any bytes that have arrived from the host without blocking.
+  void poll();
+
+  uint8_t recv();
+  // Non-blocking recv(). Returns false if no data is available yet.
+  bool tryRecv(uint8_t * const data);
+  uint16_t recv2();
+  uint32_t recv4();
+
+  void send(const uint8_t data);
+  void send2(const uint16_t word);
+  void send4(const uint32_t word);
+  void flush();
+
+  // Switch the link to a new baud rate. Anything sent before this call goes
+  // out at the old rate. The host must then reset the link at the new rate
+  // within BAUD_HANDSHAKE_TIMEOUT_MS, or the old rate is restored. Once the
+  // first reset has been seen the new rate is kept. Returns whether the switch
+  // was kept.
+  bool setBaudRate(const uint32_t baud);
+  // Return to DEFAULT_BAUD once everything sent so far has gone out.
+  void resetBaudRate();
+
+  // Whether the link has been reset since the last endRequest(). Reads then
+  // return 0xFF and writes are discarded, so nothing read since should be
+  // acted on.
+  bool aborted();
+  // Called once the response to a request has been sent, to start taking
+  // requests again after a reset.
+  void endRequest();
+}
+
+#endif
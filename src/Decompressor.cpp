@@ -0,0 +1,113 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Decompressor.hpp"
+#include "Stats.hpp"
+#include "Util.hpp"
+
+static_assert(Decompressor::WINDOW_SIZE == 256, "history is indexed by a uint8_t");
+
+static uint8_t history[Decompressor::WINDOW_SIZE];
+static uint8_t historyPos;
+
+static Util::ByteProviderCallback source;
+static Util::ByteTryProviderCallback trySource;
+static uint16_t streamLen;
+static uint16_t streamLeft;
+static uint16_t decoded;
+static bool overrun;
+
+// The operation being decoded. A copy token is only acted on once its
+// distance has arrived too.
+static bool haveToken = false;
+static uint8_t token;
+static uint8_t literalsLeft = 0;
+static uint8_t copiesLeft = 0;
+static uint8_t distance;
+
+void Decompressor::begin(const Util::ByteProviderCallback source_, const Util::ByteTryProviderCallback trySource_, const uint16_t len) {
+  for (uint16_t i = 0; i < WINDOW_SIZE; i++) {
+    history[i] = 0xFF;
+  }
+  historyPos = 0;
+  source = source_;
+  trySource = trySource_;
+  streamLen = len;
+  streamLeft = len;
+  decoded = 0;
+  overrun = false;
+  haveToken = false;
+  literalsLeft = 0;
+  copiesLeft = 0;
+}
+
+// Take the next byte of the stream, or 0xFF once it has run out.
+static bool input(const bool block, uint8_t * const byte) {
+  if (!streamLeft) {
+    overrun = true;
+    *byte = 0xFF;
+    return true;
+  }
+  if (block) {
+    *byte = source();
+  } else if (!trySource(byte)) {
+    return false;
+  }
+  streamLeft--;
+  return true;
+}
+
+static bool produce(const bool block, uint8_t * const data) {
+  if (!literalsLeft && !copiesLeft) {
+    if (!streamLeft && !haveToken) {
+      overrun = true;
+      *data = 0xFF;
+      return true;
+    }
+    if (!haveToken) {
+      if (!input(block, &token)) { return false; }
+      haveToken = true;
+    }
+    if (token & 0x80) {
+      if (!input(block, &distance)) { return false; }
+      copiesLeft = (token & 0x7F) + Decompressor::MIN_COPY;
+    } else {
+      literalsLeft = token + 1;
+    }
+    haveToken = false;
+  }
+
+  uint8_t byte;
+  if (literalsLeft) {
+    if (!input(block, &byte)) { return false; }
+    literalsLeft--;
+  } else {
+    byte = history[(uint8_t) (historyPos - distance - 1)];
+    copiesLeft--;
+  }
+  history[historyPos++] = byte;
+  decoded++;
+  *data = byte;
+  return true;
+}
+
+uint8_t Decompressor::recv() {
+  uint8_t data;
+  produce(true, &data);
+  return data;
+}
+
+bool Decompressor::tryRecv(uint8_t * const data) {
+  return produce(false, data);
+}
+
+bool Decompressor::end() {
+  const bool leftOver = streamLeft || haveToken || literalsLeft || copiesLeft;
+  while (streamLeft) {
+    source();
+    streamLeft--;
+  }
+  Stats::count(Stats::Counter::COMPRESSED_BYTES, streamLen);
+  Stats::count(Stats::Counter::DECOMPRESSED_BYTES, decoded);
+  return !overrun && !leftOver;
+}
@@ -0,0 +1,37 @@
+#ifndef __PDIPROG_DECOMPRESSOR_HPP
+#define __PDIPROG_DECOMPRESSOR_HPP
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Util.hpp"
+
+// Byte-aligned LZ77 decoder with a 256-byte window, for images sent
+// compressed over the host link. The stream is a sequence of:
+//
+//   0LLLLLLL bytes[L + 1]        literal run of 1-128 bytes
+//   1LLLLLLL distance            copy L + 3 (3-130) bytes from distance + 1
+//                                (1-256) bytes back
+//
+// Copies may overlap what they produce, so a run of one byte is a literal and
+// a copy from one byte back. History from before the start of the stream
+// reads as 0xFF.
+namespace Decompressor {
+  static constexpr uint16_t WINDOW_SIZE = 256;
+  static constexpr uint8_t MIN_COPY = 3;
+
+  // Decode the next `len` bytes from `source`. `trySource` is used by
+  // tryRecv().
+  void begin(const Util::ByteProviderCallback source, const Util::ByteTryProviderCallback trySource, const uint16_t len);
+
+  // Decoded bytes, for NVM::Flash::write. Once the stream has run out these
+  // are 0xFF.
+  uint8_t recv();
+  bool tryRecv(uint8_t * const data);
+
+  // Discard whatever is left of the stream. Returns false if it ran out
+  // before enough bytes were decoded, or had some left over.
+  bool end();
+}
+
+#endif
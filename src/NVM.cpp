@@ -1,24 +1,479 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+
+#include "CRC.hpp"
 #include "NVM.hpp"
 #include "PDI.hpp"
+#include "Platform.hpp"
+#include "Stats.hpp"
 #include "TargetConfig.hpp"
 #include "Util.hpp"
 
-static bool activeFlag = false;
+static constexpr uint8_t NVMEN_MASK = 0x02;
+
+enum class Op : uint8_t {
+  NONE,
+  OTHER,
+  PAGE_ERASE,
+  PAGE_WRITE,
+  PAGE_ERASE_WRITE,
+  SECTION_ERASE,
+  CHIP_ERASE,
+  FUSE_WRITE,
+};
+
+// Running CRC of the data written to a flash section since it was erased,
+// used to predict the result of the target's CRC command. Unwritten bytes are
+// erased (0xFF).
+class ExpectedCRC {
+public:
+  bool valid;
+  uint32_t crc;
+  uint32_t next;
+  uint8_t low;
+
+  void reset() {
+    valid = true;
+    crc = CRC::CRC24_INIT;
+    next = 0;
+  }
+
+  void update(const uint8_t byte) {
+    if (next & 1) {
+      crc = CRC::update24(crc, low | (((uint16_t) byte) << 8));
+    } else {
+      low = byte;
+    }
+    next++;
+  }
+
+  void padTo(const uint32_t addr) {
+    while (next < addr) {
+      update(0xFF);
+    }
+  }
+
+  void write(const uint32_t addr, const uint8_t * const data, const uint16_t len) {
+    if (!valid) { return; }
+    if (addr < next) {
+      // Rewriting flash we have already accounted for.
+      valid = false;
+      return;
+    }
+    padTo(addr);
+    for (uint16_t i = 0; i < len; i++) {
+      update(data[i]);
+    }
+  }
+};
+
+// What we know about the target on each PDI channel.
+class TargetState {
+public:
+  bool active;
+
+  // What NVM::identify() found. The flash, EEPROM and user signature are
+  // sized from this.
+  uint8_t signature[TargetConfig::DEVID_LEN];
+  TargetConfig::Device device;
+
+  // The NVM interface stays enabled once the key has been accepted, so this
+  // only needs checking once per attach.
+  bool busEnabled;
+
+  // What the controller was last asked to do, and when. This lets
+  // waitWhileControllerBusy() skip polling a controller that cannot be busy,
+  // and leave one that is busy alone for as long as the operation typically
+  // takes.
+  Op pendingOp;
+  uint32_t pendingStart;
+
+  // Shadows of target state that is expensive to set. The CMD register keeps
+  // its value until changed, and the flash page buffer is cleared by the
+  // target whenever a page is written from it.
+  bool cmdKnown;
+  NVM::Controller::Cmd cmdShadow;
+  bool pageBufferDirty;
+  bool eepromBufferDirty;
+
+  ExpectedCRC appCRC;
+  ExpectedCRC bootCRC;
+
+  // Flash pages known to be erased, one bit for each page from the start of
+  // flash. A page we are unsure of counts as not erased.
+  uint8_t erasedPages[(TargetConfig::MAX_FLASH_PAGES + 7) / 8];
+};
+
+static TargetState channelStates[Platform::TargetSerial::MAX_CHANNELS];
+static TargetState * ch = &channelStates[0];
+
+static constexpr uint32_t usToTicks(const uint32_t us) {
+  return us * (Platform::Timer::TICK_HZ / 1000) / 1000;
+}
+
+static constexpr uint32_t MIN_POLL_INTERVAL = usToTicks(32);
+static constexpr uint32_t MAX_POLL_INTERVAL = usToTicks(1024);
+
+// Somewhat less than the typical duration of each operation, so that the first
+// poll usually finds the controller just finished.
+static uint32_t firstPollDelay(const Op op) {
+  switch (op) {
+    case Op::PAGE_ERASE:       { return usToTicks(3000); }
+    case Op::PAGE_WRITE:       { return usToTicks(3000); }
+    case Op::PAGE_ERASE_WRITE: { return usToTicks(6000); }
+    case Op::SECTION_ERASE:    { return usToTicks(4500); }
+    case Op::CHIP_ERASE:       { return usToTicks(40000); }
+    default:                   { return 0; }
+  }
+}
+
+// The phase each operation is timed under, if any.
+static bool opPhase(const Op op, Stats::Phase * const phase) {
+  switch (op) {
+    case Op::PAGE_ERASE:
+    case Op::PAGE_WRITE:
+    case Op::PAGE_ERASE_WRITE: { *phase = Stats::Phase::PAGE_COMMIT; return true; }
+    case Op::SECTION_ERASE:    { *phase = Stats::Phase::SECTION_ERASE; return true; }
+    case Op::CHIP_ERASE:       { *phase = Stats::Phase::CHIP_ERASE; return true; }
+    case Op::FUSE_WRITE:       { *phase = Stats::Phase::FUSE_WRITE; return true; }
+    default:                   { return false; }
+  }
+}
+
+static void started(const Op op) {
+  ch->pendingOp = op;
+  ch->pendingStart = Platform::Timer::ticks();
+}
+
+static void finished() {
+  Stats::Phase phase;
+  if (opPhase(ch->pendingOp, &phase)) {
+    Stats::record(phase, Platform::Timer::ticks() - ch->pendingStart);
+  }
+  ch->pendingOp = Op::NONE;
+}
+
+// Page staging for NVM::Flash::write. While one buffer is being pushed to the
+// target and committed, the other is filled from the host whenever we would
+// otherwise be idle waiting for the NVM controller.
+static uint8_t stagingBuffers[2][TargetConfig::MAX_FLASH_PAGE_SIZE];
+
+static Util::ByteTryProviderCallback stageSource = nullptr;
+static uint8_t * stageBuffer;
+static uint16_t stageLen = 0;
+static uint16_t stageFilled = 0;
+
+static void beginStage(uint8_t * const buffer, const uint16_t len, const Util::ByteTryProviderCallback source) {
+  stageBuffer = buffer;
+  stageLen = len;
+  stageFilled = 0;
+  stageSource = source;
+}
+
+// Take whatever bytes are available without blocking.
+static void fillStage() {
+  if (!stageSource) { return; }
+  while (stageFilled < stageLen && stageSource(&stageBuffer[stageFilled])) {
+    stageFilled++;
+  }
+}
+
+// Block until the stage is full.
+static void completeStage(const Util::ByteProviderCallback callback) {
+  while (stageFilled < stageLen) {
+    stageBuffer[stageFilled] = callback();
+    stageFilled++;
+  }
+  stageSource = nullptr;
+}
+
+static uint16_t skippedPageCount = 0;
+static uint16_t unchangedEEPROMPageCount = 0;
+
+static bool isErased(const uint8_t * const data, const uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    if (data[i] != 0xFF) { return false; }
+  }
+  return true;
+}
+
+static ExpectedCRC * expectedCRC(const NVM::Flash::Section section) {
+  using NVM::Flash::Section;
+
+  switch (section) {
+    case Section::APP:  { return &ch->appCRC; }
+    case Section::BOOT: { return &ch->bootCRC; }
+    default:            { return nullptr; }
+  }
+}
+
+static uint32_t sectionSize(const NVM::Flash::Section section) {
+  using NVM::Flash::Section;
+
+  switch (section) {
+    case Section::APP:  { return ch->device.appSize(); }
+    case Section::BOOT: { return ch->device.bootSize(); }
+    default:            { return ch->device.appSize() + ch->device.bootSize(); }
+  }
+}
+
+static uint32_t realFlashAddr(const uint32_t flashAddr, const NVM::Flash::Section section) {
+  using NVM::Flash::Section;
+
+  switch (section) {
+    case Section::APP:  { return TargetConfig::FLASH_APP_START + flashAddr; }
+    case Section::BOOT: { return ch->device.bootStart() + flashAddr; }
+    default:            { return TargetConfig::FLASH_START + flashAddr; }
+  }
+}
+
+// The number of flash pages for an address past the end of flash.
+static uint16_t pageIndex(const uint32_t flashAddr, const NVM::Flash::Section section) {
+  const uint32_t page = (realFlashAddr(flashAddr, section) - TargetConfig::FLASH_START) >> ch->device.flashPageShift;
+  return (page < ch->device.flashPages()) ? page : ch->device.flashPages();
+}
+
+static bool pageErased(const uint16_t page) {
+  if (page >= ch->device.flashPages()) { return false; }
+  return ch->erasedPages[page / 8] & (1 << (page % 8));
+}
+
+static void setPagesErased(const uint16_t firstPage, const uint16_t count, const bool erased) {
+  for (uint16_t page = firstPage; page < firstPage + count && page < ch->device.flashPages(); page++) {
+    const uint8_t bit = 1 << (page % 8);
+    if (erased) {
+      ch->erasedPages[page / 8] |= bit;
+    } else {
+      ch->erasedPages[page / 8] &= ~bit;
+    }
+  }
+}
+
+static uint16_t sectionFirstPage(const NVM::Flash::Section section) {
+  return (section == NVM::Flash::Section::BOOT) ? ch->device.appPages : 0;
+}
+
+static uint16_t sectionPages(const NVM::Flash::Section section) {
+  return sectionSize(section) >> ch->device.flashPageShift;
+}
+
+static bool sectionErased(const NVM::Flash::Section section) {
+  const uint16_t first = sectionFirstPage(section);
+  for (uint16_t page = first; page < first + sectionPages(section); page++) {
+    if (!pageErased(page)) { return false; }
+  }
+  return true;
+}
 
 void NVM::init() {
-  activeFlag = false;
+  for (uint8_t i = 0; i < Platform::TargetSerial::MAX_CHANNELS; i++) {
+    channelStates[i].active = false;
+  }
+  ch = &channelStates[0];
   PDI::init();
 }
 
-void NVM::begin() {
+uint8_t NVM::channels() {
+  return PDI::channels();
+}
+
+void NVM::select(const uint8_t channel) {
+  PDI::select(channel);
+  ch = &channelStates[channel];
+}
+
+uint8_t NVM::selected() {
+  return PDI::selected();
+}
+
+static void attach(const uint32_t clock, const PDI::GuardTime gt) {
+  ch->busEnabled = false;
+  ch->pendingOp = Op::OTHER;
+  ch->cmdKnown = false;
+  ch->pageBufferDirty = true;
+  ch->eepromBufferDirty = true;
+  PDI::setClock(clock);
   PDI::begin();
   PDI::enterResetState();
-  PDI::setGuardTime(PDI::GuardTime::_32);
+  PDI::setGuardTime(gt);
   PDI::Instruction::key();
-  activeFlag = true;
+}
+
+static uint8_t testByte(const uint8_t round, const uint8_t i) {
+  // Alternate rounds are complemented so that every bit is seen both ways.
+  const uint8_t byte = (i + round) * 0x3B;
+  return (round & 1) ? ~byte : byte;
+}
+
+// Exercise the link at its current settings. The NVM interface must still be
+// enabled, and a block written to the target's SRAM using REPEAT must read back
+// intact.
+static bool linkTest() {
+  static constexpr uint8_t ROUNDS = 4;
+  static constexpr uint8_t LEN = 16;
+  uint8_t buffer[LEN];
+
+  for (uint8_t round = 0; round < ROUNDS; round++) {
+    const Util::MaybeUint8 result = PDI::Instruction::ldcs(PDI::CSReg::STATUS);
+    if (!result.ok() || !(result.data & NVMEN_MASK)) { return false; }
+
+    for (uint8_t i = 0; i < LEN; i++) {
+      buffer[i] = testByte(round, i);
+    }
+    PDI::Instruction::st4(PDI::PtrMode::DIRECT, TargetConfig::SRAM_START);
+    PDI::Instruction::bulkSt(PDI::PtrMode::INDIRECT_INCR, buffer, LEN);
+    PDI::Instruction::st4(PDI::PtrMode::DIRECT, TargetConfig::SRAM_START);
+    const Util::Status status = PDI::Instruction::bulkLd(PDI::PtrMode::INDIRECT_INCR, buffer, LEN);
+    if (status != Util::Status::OK) { return false; }
+    for (uint8_t i = 0; i < LEN; i++) {
+      if (buffer[i] != testByte(round, i)) { return false; }
+    }
+  }
+  return true;
+}
+
+static Util::Status waitWhileBusBusy();
+
+// Go back to settings that are known to work after a failed linkTest().
+static void recover(const uint32_t clock, const PDI::GuardTime gt) {
+  PDI::setClock(clock);
+  PDI::sendBreak();
+  PDI::setGuardTime(gt);
+  if (linkTest()) { return; }
+
+  // The target did not come back; let its PDI time out and start again.
+  PDI::end();
+  _delay_ms(1);
+  attach(clock, gt);
+  waitWhileBusBusy();
+}
+
+// Times a read or page write is tried again after the link fails.
+static constexpr uint8_t RETRIES = 2;
+
+static bool retryable(const Util::Status status) {
+  switch (status) {
+    case Util::Status::SERIAL_ERROR:
+    case Util::Status::SERIAL_TIMEOUT:
+    case Util::Status::SHADOW_MISMATCH: {
+      return true;
+    }
+    default: {
+      return false;
+    }
+  }
+}
+
+// Get the link working again after an error, forgetting what we knew of the
+// target's state.
+static void relink() {
+  // An erase may or may not have happened.
+  setPagesErased(0, ch->device.flashPages(), false);
+  ch->cmdKnown = false;
+  ch->pageBufferDirty = true;
+  ch->eepromBufferDirty = true;
+  recover(PDI::clock(), PDI::guardTime());
+}
+
+// Find the fastest clock, then the shortest guard time, at which the link
+// still works. The guard time is the idle time the target inserts before each
+// response, so it matters most for polling.
+static void calibrate() {
+  uint32_t goodClock = PDI::clock();
+  PDI::GuardTime goodGt = PDI::guardTime();
+
+  while (goodClock < PDI::MAX_BAUD_RATE) {
+    const uint32_t next = (goodClock * 2 < PDI::MAX_BAUD_RATE) ? goodClock * 2 : PDI::MAX_BAUD_RATE;
+    PDI::setClock(next);
+    if (PDI::clock() <= goodClock) {
+      // The platform cannot go any faster within the limit.
+      PDI::setClock(goodClock);
+      break;
+    }
+    if (!linkTest()) {
+      recover(goodClock, goodGt);
+      break;
+    }
+    goodClock = PDI::clock();
+  }
+
+  while (goodGt != PDI::GuardTime::_2) {
+    const PDI::GuardTime next = (PDI::GuardTime) (((uint8_t) goodGt) + 1);
+    PDI::setGuardTime(next);
+    if (!linkTest()) {
+      recover(goodClock, goodGt);
+      break;
+    }
+    goodGt = next;
+  }
+}
+
+void NVM::begin() {
+  // We know nothing about the target's flash contents until it is erased.
+  ch->appCRC.valid = false;
+  ch->bootCRC.valid = false;
+  for (uint8_t & bits : ch->erasedPages) {
+    bits = 0;
+  }
+  // The target may have been swapped for another device.
+  for (uint8_t & byte : ch->signature) {
+    byte = 0;
+  }
+  ch->device.id = 0;
+  ch->device.flashPageShift = 0;
+  ch->device.appPages = 0;
+  ch->device.bootPages = 0;
+  ch->device.eepromSize = 0;
+  skippedPageCount = 0;
+  unchangedEEPROMPageCount = 0;
+  Stats::start(Stats::Phase::ATTACH);
+  attach(PDI::BAUD_RATE, PDI::GuardTime::_32);
+  // If the target is not responding at all, leave the defaults in place and
+  // let the first real operation report the failure.
+  if (waitWhileBusBusy() == Util::Status::OK && linkTest()) {
+    calibrate();
+    NVM::identify();
+  }
+  Stats::stop(Stats::Phase::ATTACH);
+  ch->active = true;
+}
+
+// Copy the entry for `id` out of program memory.
+static bool findDevice(const uint16_t id, TargetConfig::Device * const device) {
+  for (uint8_t i = 0; i < TargetConfig::DEVICE_COUNT; i++) {
+    const TargetConfig::Device * const entry = &TargetConfig::DEVICES[i];
+    if (pgm_read_word(&entry->id) != id) { continue; }
+    device->flashPageShift = pgm_read_byte(&entry->flashPageShift);
+    device->appPages = pgm_read_word(&entry->appPages);
+    device->bootPages = pgm_read_word(&entry->bootPages);
+    device->eepromSize = pgm_read_word(&entry->eepromSize);
+    device->id = id;
+    return true;
+  }
+  return false;
+}
+
+Util::Status NVM::identify() {
+  if (ch->device.id) { return Util::Status::OK; }
+
+  const Util::Status status = NVM::read(TargetConfig::DEVID_START, ch->signature, TargetConfig::DEVID_LEN);
+  if (status != Util::Status::OK) { return status; }
+  const uint16_t id = (((uint16_t) ch->signature[1]) << 8) | ch->signature[2];
+  if (ch->signature[0] != TargetConfig::MANUFACTURER_ID || !findDevice(id, &ch->device)) {
+    return Util::Status::UNKNOWN_DEVICE;
+  }
+  return Util::Status::OK;
+}
+
+const TargetConfig::Device & NVM::device() {
+  return ch->device;
+}
+
+const uint8_t * NVM::signature() {
+  return ch->signature;
 }
 
 static Util::Status exitResetAndWait() {
@@ -36,7 +491,7 @@ static Util::Status exitResetAndWait() {
 }
 
 void NVM::end() {
-  activeFlag = false;
+  ch->active = false;
   // Deliberately ignore Util::Status results here - in the event of a failure
   // we should proceed with shutting down the PDI link anyway.
   NVM::Controller::waitWhileBusy();
@@ -45,20 +500,28 @@ void NVM::end() {
 }
 
 bool NVM::active() {
-  return activeFlag;
+  return ch->active;
 }
 
 uint32_t NVM::Controller::regAddr(const NVM::Controller::Reg reg) {
   return TargetConfig::NVM_REGS_START + ((uint32_t) reg);
 }
 
+Util::MaybeUint8 NVM::Controller::readReg(const NVM::Controller::Reg reg) {
+  const uint32_t addr = NVM::Controller::regAddr(reg);
+  return PDI::Instruction::lds41(addr);
+}
+
 void NVM::Controller::writeReg(const NVM::Controller::Reg reg, const uint8_t data) {
   const uint32_t addr = NVM::Controller::regAddr(reg);
   PDI::Instruction::sts41(addr, data);
 }
 
 void NVM::Controller::writeCmd(const NVM::Controller::Cmd cmd) {
+  if (ch->cmdKnown && ch->cmdShadow == cmd) { return; }
   NVM::Controller::writeReg(NVM::Controller::Reg::CMD, (uint8_t) cmd);
+  ch->cmdKnown = true;
+  ch->cmdShadow = cmd;
 }
 
 void NVM::Controller::writeCmdex() {
@@ -69,62 +532,118 @@ void NVM::Controller::writeCmdex() {
 void NVM::Controller::execCmd(const NVM::Controller::Cmd cmd) {
   NVM::Controller::writeCmd(cmd);
   NVM::Controller::writeCmdex();
+  started(Op::OTHER);
 }
 
 static Util::Status waitWhileBusBusy() {
-  static constexpr uint8_t NVMEN_MASK = 0x02;
+  if (ch->busEnabled) { return Util::Status::OK; }
 
   while (1) {
     const Util::MaybeUint8 result = PDI::Instruction::ldcs(PDI::CSReg::STATUS);
+    Stats::count(Stats::Counter::BUSY_POLLS);
     if (!result.ok()) {
       return result.status;
     }
     if (result.data & NVMEN_MASK) {
+      ch->busEnabled = true;
       return Util::Status::OK;
     }
+    fillStage();
+  }
+}
+
+// Stage bytes from the host until `ticks` have passed since `start`.
+static void idleUntil(const uint32_t start, const uint32_t ticks) {
+  while (Platform::Timer::ticks() - start < ticks) {
+    fillStage();
   }
 }
 
 static Util::Status waitWhileControllerBusy() {
   static constexpr uint8_t BUSY_MASK = 0x80;
 
+  if (ch->pendingOp == Op::NONE) { return Util::Status::OK; }
+  Stats::count(Stats::Counter::NVM_WAITS);
+
+  idleUntil(ch->pendingStart, firstPollDelay(ch->pendingOp));
+
   // Put address of STATUS register into PDI pointer register.
   const uint32_t addr = NVM::Controller::regAddr(NVM::Controller::Reg::STATUS);
-  PDI::Instruction::st4(PDI::PtrMode::DIRECT, addr);
+  PDI::Instruction::setPointer(addr);
 
-  // Poll STATUS register until BUSY flag is no longer set.
+  // Poll STATUS register until BUSY flag is no longer set, backing off so that
+  // a long operation does not keep the link turning around.
+  uint32_t interval = MIN_POLL_INTERVAL;
   while (1) {
     const Util::MaybeUint8 result = PDI::Instruction::ld1(PDI::PtrMode::INDIRECT);
+    Stats::count(Stats::Counter::BUSY_POLLS);
     if (!result.ok()) {
       return result.status;
     }
     if (!(result.data & BUSY_MASK)) {
+      finished();
       return Util::Status::OK;
     }
+    idleUntil(Platform::Timer::ticks(), interval);
+    if (interval < MAX_POLL_INTERVAL) { interval *= 2; }
   }
 }
 
+#ifdef PDIPROG_CHECK_SHADOW
+static Util::Status checkShadow() {
+  const Util::Status status = PDI::checkShadow();
+  if (status != Util::Status::OK) { return status; }
+  if (!ch->cmdKnown) { return Util::Status::OK; }
+  const Util::MaybeUint8 result = NVM::Controller::readReg(NVM::Controller::Reg::CMD);
+  if (!result.ok()) { return result.status; }
+  if (result.data != (uint8_t) ch->cmdShadow) {
+    ch->cmdKnown = false;
+    return Util::Status::SHADOW_MISMATCH;
+  }
+  return Util::Status::OK;
+}
+#endif
+
 Util::Status NVM::Controller::waitWhileBusy() {
   const Util::Status status = waitWhileBusBusy();
   if (status != Util::Status::OK) {
     return status;
   }
+#ifdef PDIPROG_CHECK_SHADOW
+  // Debug builds (CC_FLAGS=-DPDIPROG_CHECK_SHADOW) verify the cached target
+  // state before every operation.
+  const Util::Status shadowStatus = checkShadow();
+  if (shadowStatus != Util::Status::OK) {
+    return shadowStatus;
+  }
+#endif
   return waitWhileControllerBusy();
 }
 
-Util::Status NVM::read(const uint32_t addr, uint8_t * const buffer, const uint16_t len) {
-  if (len == 0) { return Util::Status::OK; }
-
+static Util::Status readOnce(const uint32_t addr, uint8_t * const buffer, const uint16_t len) {
   const Util::Status status = NVM::Controller::waitWhileBusy();
   if (status != Util::Status::OK) { return status; }
 
   NVM::Controller::writeCmd(NVM::Controller::Cmd::READNVM);
 
   // Set the PDI pointer to the address of the first byte.
-  PDI::Instruction::st4(PDI::PtrMode::DIRECT, addr);
+  PDI::Instruction::setPointer(addr);
 
   // Read `len` bytes using the auto-increment mode.
-  return PDI::Instruction::bulkLd12(PDI::PtrMode::INDIRECT_INCR, buffer, len);
+  return PDI::Instruction::bulkLd(PDI::PtrMode::INDIRECT_INCR, buffer, len);
+}
+
+Util::Status NVM::read(const uint32_t addr, uint8_t * const buffer, const uint16_t len) {
+  if (len == 0) { return Util::Status::OK; }
+
+  for (uint8_t retry = 0; ; retry++) {
+    const Util::Status status = readOnce(addr, buffer, len);
+    if (!retryable(status)) { return status; }
+    // Even when giving up, so that the next request can go ahead.
+    relink();
+    if (retry == RETRIES) { return status; }
+    Stats::count(Stats::Counter::RETRIES);
+  }
 }
 
 Util::Status NVM::eraseChip() {
@@ -132,23 +651,36 @@ Util::Status NVM::eraseChip() {
   if (status != Util::Status::OK) { return status; }
 
   NVM::Controller::execCmd(NVM::Controller::Cmd::CHIPERASE);
+  started(Op::CHIP_ERASE);
+  ch->appCRC.reset();
+  ch->bootCRC.reset();
+  setPagesErased(0, ch->device.flashPages(), true);
   return Util::Status::OK;
 }
 
-static uint32_t realFlashAddr(const uint32_t flashAddr, const NVM::Flash::Section section) {
-  using NVM::Flash::Section;
+Util::Status NVM::Flash::read(const uint32_t flashAddr, uint8_t * const buffer, const uint16_t len, const NVM::Flash::Section section) {
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return identifyStatus; }
 
-  switch (section) {
-    case Section::APP:  { return TargetConfig::FLASH_APP_START + flashAddr; }
-    case Section::BOOT: { return TargetConfig::FLASH_BOOT_START + flashAddr; }
-    default:            { return TargetConfig::FLASH_START + flashAddr; }
+  const Util::Status status = NVM::read(realFlashAddr(flashAddr, section), buffer, len);
+  if (status != Util::Status::OK) { return status; }
+
+  // Note which of the whole pages read are blank; they are as good as erased.
+  const uint16_t pageSize = ch->device.flashPageSize();
+  const uint16_t skip = (pageSize - (flashAddr & (pageSize - 1))) & (pageSize - 1);
+  for (uint32_t offset = skip; offset + pageSize <= len; offset += pageSize) {
+    setPagesErased(pageIndex(flashAddr + offset, section), 1, isErased(buffer + offset, pageSize));
   }
+  return Util::Status::OK;
 }
 
 Util::Status NVM::Flash::eraseSection(const uint32_t flashAddr, const NVM::Flash::Section section) {
   using NVM::Controller::Cmd;
   using NVM::Flash::Section;
 
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return identifyStatus; }
+
   const uint32_t addr = realFlashAddr(flashAddr, section);
 
   Cmd cmd;
@@ -158,11 +690,19 @@ Util::Status NVM::Flash::eraseSection(const uint32_t flashAddr, const NVM::Flash
     default:            { return Util::Status::INVALID_SECTION; }
   }
 
+  expectedCRC(section)->reset();
+  if (sectionErased(section)) {
+    Stats::count(Stats::Counter::ERASES_AVOIDED);
+    return Util::Status::OK;
+  }
+
   const Util::Status status = NVM::Controller::waitWhileBusy();
   if (status != Util::Status::OK) { return status; }
 
   NVM::Controller::writeCmd(cmd);
   PDI::Instruction::sts41(addr, 0);
+  started(Op::SECTION_ERASE);
+  setPagesErased(sectionFirstPage(section), sectionPages(section), true);
   return Util::Status::OK;
 }
 
@@ -171,11 +711,16 @@ Util::Status NVM::Flash::eraseBuffer() {
   if (status != Util::Status::OK) { return status; }
 
   NVM::Controller::execCmd(NVM::Controller::Cmd::ERASEFLASHPAGEBUFF);
+  ch->pageBufferDirty = false;
   return Util::Status::OK;
 }
 
-Util::Status NVM::Flash::writeBuffer(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const NVM::Flash::Section section) {
-  if (len > TargetConfig::FLASH_PAGE_SIZE) {
+// Get ready to load `len` bytes into the page buffer for `flashAddr`.
+static Util::Status beginLoad(const uint32_t flashAddr, const uint16_t len, const NVM::Flash::Section section) {
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return identifyStatus; }
+
+  if (len > ch->device.flashPageSize()) {
     return Util::Status::INVALID_LENGTH;
   }
 
@@ -184,14 +729,33 @@ Util::Status NVM::Flash::writeBuffer(const uint32_t flashAddr, const Util::ByteP
   const Util::Status status = NVM::Controller::waitWhileBusy();
   if (status != Util::Status::OK) { return status; }
 
+  Stats::start(Stats::Phase::PAGE_LOAD);
   NVM::Controller::writeCmd(NVM::Controller::Cmd::LOADFLASHPAGEBUFF);
 
   // Set the PDI pointer to the address at which to store the first byte.
-  PDI::Instruction::st4(PDI::PtrMode::DIRECT, addr);
+  PDI::Instruction::setPointer(addr);
+  ch->pageBufferDirty = true;
+
+  return Util::Status::OK;
+}
+
+Util::Status NVM::Flash::writeBuffer(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const NVM::Flash::Section section) {
+  const Util::Status status = beginLoad(flashAddr, len, section);
+  if (status != Util::Status::OK) { return status; }
 
   // Write `len` bytes using the auto-increment mode.
   PDI::Instruction::bulkSt12(PDI::PtrMode::INDIRECT_INCR, callback, len);
+  Stats::stop(Stats::Phase::PAGE_LOAD);
+  return Util::Status::OK;
+}
+
+Util::Status NVM::Flash::writeBuffer(const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const NVM::Flash::Section section) {
+  const Util::Status status = beginLoad(flashAddr, len, section);
+  if (status != Util::Status::OK) { return status; }
 
+  // Write `len` bytes using the auto-increment mode.
+  PDI::Instruction::bulkSt(PDI::PtrMode::INDIRECT_INCR, data, len);
+  Stats::stop(Stats::Phase::PAGE_LOAD);
   return Util::Status::OK;
 }
 
@@ -199,6 +763,9 @@ Util::Status NVM::Flash::erasePage(const uint32_t flashAddr, const NVM::Flash::S
   using NVM::Controller::Cmd;
   using NVM::Flash::Section;
 
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return identifyStatus; }
+
   const uint32_t addr = realFlashAddr(flashAddr, section);
 
   Cmd cmd;
@@ -208,11 +775,26 @@ Util::Status NVM::Flash::erasePage(const uint32_t flashAddr, const NVM::Flash::S
     default:            { cmd = Cmd::ERASEFLASHPAGE; break; }
   }
 
+  const uint16_t page = pageIndex(flashAddr, section);
+  if (pageErased(page)) {
+    Stats::count(Stats::Counter::ERASES_AVOIDED);
+    return Util::Status::OK;
+  }
+
   const Util::Status status = NVM::Controller::waitWhileBusy();
   if (status != Util::Status::OK) { return status; }
 
   NVM::Controller::writeCmd(cmd);
   PDI::Instruction::sts41(addr, 0);
+  started(Op::PAGE_ERASE);
+  setPagesErased(page, 1, true);
+  ExpectedCRC * const expected = expectedCRC(section);
+  if (expected) {
+    if (flashAddr < expected->next) { expected->valid = false; }
+  } else {
+    ch->appCRC.valid = false;
+    ch->bootCRC.valid = false;
+  }
   return Util::Status::OK;
 }
 
@@ -220,10 +802,20 @@ Util::Status NVM::Flash::writePageFromBuffer(const uint32_t flashAddr, const boo
   using NVM::Controller::Cmd;
   using NVM::Flash::Section;
 
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return identifyStatus; }
+
   const uint32_t addr = realFlashAddr(flashAddr, section);
+  const uint16_t page = pageIndex(flashAddr, section);
+
+  // A page that is already erased only needs writing.
+  const bool erase = preErase && !pageErased(page);
+  if (preErase && !erase) {
+    Stats::count(Stats::Counter::ERASES_AVOIDED);
+  }
 
   Cmd cmd;
-  if (preErase) {
+  if (erase) {
     switch (section) {
       case Section::APP:  { cmd = Cmd::ERASEWRITEAPPSECPAGE; break; }
       case Section::BOOT: { cmd = Cmd::ERASEWRITEBOOTSECPAGE; break; }
@@ -243,30 +835,460 @@ Util::Status NVM::Flash::writePageFromBuffer(const uint32_t flashAddr, const boo
 
   NVM::Controller::writeCmd(cmd);
   PDI::Instruction::sts41(addr, 0);
+  started(erase ? Op::PAGE_ERASE_WRITE : Op::PAGE_WRITE);
+  setPagesErased(page, 1, false);
+  ch->pageBufferDirty = false;
   return Util::Status::OK;
 }
 
+// The page buffer must be erased before being loaded again, but writing a page
+// from it does that already.
+static Util::Status ensurePageBufferClean() {
+  if (!ch->pageBufferDirty) { return Util::Status::OK; }
+  return NVM::Flash::eraseBuffer();
+}
+
 Util::Status NVM::Flash::writePage(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
-  const Util::Status eraseStatus = NVM::Flash::eraseBuffer();
+  const Util::Status eraseStatus = ensurePageBufferClean();
   if (eraseStatus != Util::Status::OK) { return eraseStatus; }
   const Util::Status writeStatus = NVM::Flash::writeBuffer(flashAddr, callback, len, section);
   if (writeStatus != Util::Status::OK) { return writeStatus; }
   return NVM::Flash::writePageFromBuffer(flashAddr, preErase, section);
 }
 
-Util::Status NVM::Flash::write(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
+Util::Status NVM::Flash::writePage(const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
+  const Util::Status eraseStatus = ensurePageBufferClean();
+  if (eraseStatus != Util::Status::OK) { return eraseStatus; }
+  const Util::Status writeStatus = NVM::Flash::writeBuffer(flashAddr, data, len, section);
+  if (writeStatus != Util::Status::OK) { return writeStatus; }
+  return NVM::Flash::writePageFromBuffer(flashAddr, preErase, section);
+}
+
+// Erasing is all that an erase-write of a blank page would do.
+static Util::Status writePageOnce(const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
+  if (preErase && isErased(data, len)) {
+    return NVM::Flash::erasePage(flashAddr, section);
+  }
+  return NVM::Flash::writePage(flashAddr, data, len, preErase, section);
+}
+
+// A PDI send is never acknowledged, so a link error while a page is loaded
+// or committed only shows when the controller is next polled. A page counts
+// as written once its commit has been seen to finish; until then it is
+// written again, from `data`, after each link error. `status` is what
+// writePageOnce() returned.
+static Util::Status finishPage(const Util::Status status, const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
+  Util::Status result = status;
+  if (result == Util::Status::OK) {
+    result = NVM::Controller::waitWhileBusy();
+  }
+  for (uint8_t retry = 0; retryable(result); retry++) {
+    relink();
+    if (retry == RETRIES) { return result; }
+    Stats::count(Stats::Counter::RETRIES);
+    result = writePageOnce(flashAddr, data, len, preErase, section);
+    if (result == Util::Status::OK) {
+      result = NVM::Controller::waitWhileBusy();
+    }
+  }
+  return result;
+}
+
+Util::Status NVM::Flash::write(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const Util::ByteTryProviderCallback tryCallback, const Util::AbortCallback aborted, const uint16_t len, const bool preErase, const NVM::Flash::Section section) {
+  uint8_t failed;
+  uint32_t failedAddr;
+  return NVM::Flash::writeTargets(1 << NVM::selected(), flashAddr, callback, tryCallback, aborted, len, preErase, section, &failed, &failedAddr);
+}
+
+Util::Status NVM::Flash::writeTargets(const uint8_t targets, const uint32_t flashAddr, const Util::ByteProviderCallback callback, const Util::ByteTryProviderCallback tryCallback, const Util::AbortCallback aborted, const uint16_t len, const bool preErase, const NVM::Flash::Section section, uint8_t * const failed, uint32_t * const failedAddr) {
+  const uint8_t originalChannel = NVM::selected();
+  uint8_t live = targets;
+  Util::Status result = Util::Status::OK;
+  *failed = 0;
+  *failedAddr = NO_FAILURE;
+
+  // Pages are split up as they are on the first target, so every other
+  // target must be the same device.
+  const TargetConfig::Device * device = nullptr;
+  for (uint8_t channel = 0; channel < Platform::TargetSerial::MAX_CHANNELS; channel++) {
+    const uint8_t bit = 1 << channel;
+    if (!(targets & bit)) { continue; }
+    NVM::select(channel);
+
+    Util::Status status = NVM::identify();
+    if (status == Util::Status::OK && !device) {
+      device = &ch->device;
+    } else if (status == Util::Status::OK && ch->device.id != device->id) {
+      status = Util::Status::DEVICE_MISMATCH;
+    }
+    if (status != Util::Status::OK) {
+      live &= ~bit;
+      *failed |= bit;
+      *failedAddr = flashAddr;
+      result = status;
+    }
+  }
+  const uint16_t pageSize = device ? device->flashPageSize() : TargetConfig::MAX_FLASH_PAGE_SIZE;
+
   uint32_t currFlashAddr = flashAddr;
-  uint16_t currLen = len;
+  uint16_t currLen = Util::min(len, pageSize);
+  uint16_t remaining = len - currLen;
+  uint8_t curr = 0;
+
+  if (!expectedCRC(section)) {
+    for (uint8_t channel = 0; channel < Platform::TargetSerial::MAX_CHANNELS; channel++) {
+      if (!(targets & (1 << channel))) { continue; }
+      channelStates[channel].appCRC.valid = false;
+      channelStates[channel].bootCRC.valid = false;
+    }
+  }
+
+  // Stage the first page.
+  beginStage(stagingBuffers[curr], currLen, nullptr);
+  completeStage(callback);
+
   while (currLen) {
-    const uint16_t chunkLen = Util::min(currLen, TargetConfig::FLASH_PAGE_SIZE);
-    const Util::Status status = NVM::Flash::writePage(currFlashAddr, callback, chunkLen, preErase, section);
+    // The staged page may have been padded out after the host gave up.
+    if (aborted()) {
+      result = Util::Status::ABORTED;
+      break;
+    }
+
+    // Start staging the next page. It fills in the background while this one
+    // is loaded and while we wait for the previous commit to finish, and then
+    // blocks on the host only while the target is busy with this commit.
+    const uint16_t nextLen = Util::min(remaining, pageSize);
+    remaining -= nextLen;
+    beginStage(stagingBuffers[curr ^ 1], nextLen, tryCallback);
+
+    // Programming erased-state bytes without erasing first cannot change the
+    // flash, so such pages need not be sent to the target at all. This makes
+    // sparse images cheap to write after an erase. With `preErase`, they can
+    // still be skipped on targets where the page is known to be erased.
+    const bool blank = isErased(stagingBuffers[curr], currLen);
+    bool skipped = false;
+    uint8_t started = 0;
+    Util::Status startStatus[Platform::TargetSerial::MAX_CHANNELS];
+
+    // Each target in turn gets the page and starts committing it, so each
+    // commit has the other targets' page loads to finish in and the targets'
+    // NVM controllers work in parallel.
+    for (uint8_t channel = 0; channel < Platform::TargetSerial::MAX_CHANNELS; channel++) {
+      const uint8_t bit = 1 << channel;
+      if (!(live & bit)) { continue; }
+      NVM::select(channel);
+
+      ExpectedCRC * const expected = expectedCRC(section);
+      if (expected) {
+        expected->write(currFlashAddr, stagingBuffers[curr], currLen);
+      }
+      if (blank && (!preErase || pageErased(pageIndex(currFlashAddr, section)))) {
+        skipped = true;
+        continue;
+      }
+
+      startStatus[channel] = writePageOnce(currFlashAddr, stagingBuffers[curr], currLen, preErase, section);
+      started |= bit;
+    }
+
+    // Then each commit is seen through while the next page is staged. This
+    // page's buffer is not refilled until they all have been, so it can be
+    // written again from there.
+    for (uint8_t channel = 0; channel < Platform::TargetSerial::MAX_CHANNELS; channel++) {
+      const uint8_t bit = 1 << channel;
+      if (!(started & bit)) { continue; }
+      NVM::select(channel);
+
+      const Util::Status status = finishPage(startStatus[channel], currFlashAddr, stagingBuffers[curr], currLen, preErase, section);
+      if (status != Util::Status::OK) {
+        // Carry on with the others.
+        if (!*failed) {
+          *failedAddr = currFlashAddr;
+        }
+        live &= ~bit;
+        *failed |= bit;
+        result = status;
+      }
+    }
+    if (skipped) {
+      skippedPageCount++;
+    }
+    completeStage(callback);
+    if (!live) { break; }
+
+    currFlashAddr += (uint32_t) currLen;
+    currLen = nextLen;
+    curr ^= 1;
+  }
+
+  // Keep in step with the caller's data if every target has failed.
+  for (; remaining; remaining--) {
+    callback();
+  }
+  NVM::select(originalChannel);
+  return result;
+}
+
+uint16_t NVM::Flash::skippedPages() {
+  return skippedPageCount;
+}
+
+Util::MaybeUint32 NVM::Flash::crc(const NVM::Flash::Section section) {
+  using NVM::Controller::Cmd;
+  using NVM::Controller::Reg;
+  using NVM::Flash::Section;
+
+  const Util::Status identifyStatus = NVM::identify();
+  if (identifyStatus != Util::Status::OK) { return Util::MaybeUint32(identifyStatus); }
+
+  const Util::Status status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return Util::MaybeUint32(status); }
+
+  // The section CRCs are triggered by a write to any address in the section;
+  // the whole-flash CRC by CMDEX.
+  switch (section) {
+    case Section::APP: {
+      NVM::Controller::writeCmd(Cmd::APPCRC);
+      PDI::Instruction::sts41(realFlashAddr(0, section), 0);
+      started(Op::OTHER);
+      break;
+    }
+    case Section::BOOT: {
+      NVM::Controller::writeCmd(Cmd::BOOTCRC);
+      PDI::Instruction::sts41(realFlashAddr(0, section), 0);
+      started(Op::OTHER);
+      break;
+    }
+    default: {
+      NVM::Controller::execCmd(Cmd::FLASHCRC);
+      break;
+    }
+  }
+
+  const Util::Status crcStatus = NVM::Controller::waitWhileBusy();
+  if (crcStatus != Util::Status::OK) { return Util::MaybeUint32(crcStatus); }
+
+  // The result is left in DATA0..DATA2.
+  static constexpr uint8_t DATA_REGS = 3;
+  static const Reg regs[DATA_REGS] = { Reg::DATA0, Reg::DATA1, Reg::DATA2 };
+  uint32_t result = 0;
+  for (uint8_t i = 0; i < DATA_REGS; i++) {
+    const Util::MaybeUint8 byte = NVM::Controller::readReg(regs[i]);
+    if (!byte.ok()) { return Util::MaybeUint32(byte.status); }
+    result |= ((uint32_t) byte.data) << (8 * i);
+  }
+  return Util::MaybeUint32(Util::Status::OK, result);
+}
+
+void NVM::Flash::forgetErased(const NVM::Flash::Section section) {
+  setPagesErased(sectionFirstPage(section), sectionPages(section), false);
+}
+
+Util::MaybeUint32 NVM::Flash::expectedCrc(const NVM::Flash::Section section) {
+  ExpectedCRC * const expected = expectedCRC(section);
+  if (!expected || !expected->valid) {
+    return Util::MaybeUint32(Util::Status::INVALID_SECTION);
+  }
+  // Account for the erased remainder of the section.
+  expected->padTo(sectionSize(section));
+  return Util::MaybeUint32(Util::Status::OK, expected->crc);
+}
+
+// Load `len` bytes into the EEPROM page buffer. Only the loaded bytes are
+// affected by the page erase and write commands.
+static Util::Status loadEEPROMBuffer(const uint32_t addr, const uint8_t * const data, const uint16_t len) {
+  using NVM::Controller::Cmd;
+
+  Util::Status status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return status; }
+
+  if (ch->eepromBufferDirty) {
+    NVM::Controller::execCmd(Cmd::ERASEEEPROMPAGEBUFF);
+    status = NVM::Controller::waitWhileBusy();
     if (status != Util::Status::OK) { return status; }
-    currFlashAddr += (uint32_t) chunkLen;
-    currLen -= chunkLen;
+  }
+
+  Stats::start(Stats::Phase::PAGE_LOAD);
+  NVM::Controller::writeCmd(Cmd::LOADEEPROMPAGEBUFF);
+  PDI::Instruction::setPointer(addr);
+  PDI::Instruction::bulkSt(PDI::PtrMode::INDIRECT_INCR, data, len);
+  Stats::stop(Stats::Phase::PAGE_LOAD);
+  ch->eepromBufferDirty = true;
+  return Util::Status::OK;
+}
+
+static Util::Status commitEEPROMPage(const NVM::Controller::Cmd cmd, const uint32_t addr, const Op op) {
+  const Util::Status status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return status; }
+
+  NVM::Controller::writeCmd(cmd);
+  PDI::Instruction::sts41(addr, 0);
+  started(op);
+  if (cmd != NVM::Controller::Cmd::ERASEEEPROMPAGE) {
+    // Writing a page clears the page buffer; erasing it does not.
+    ch->eepromBufferDirty = false;
   }
   return Util::Status::OK;
 }
 
+static Util::Status checkEEPROMRange(const uint16_t eepromAddr, const uint16_t len) {
+  const Util::Status status = NVM::identify();
+  if (status != Util::Status::OK) { return status; }
+  const uint16_t size = ch->device.eepromSize;
+  if (eepromAddr > size || len > size - eepromAddr) { return Util::Status::INVALID_LENGTH; }
+  return Util::Status::OK;
+}
+
+// Length of the part of [eepromAddr, eepromAddr + remaining) in the first page.
+static uint16_t eepromChunkLen(const uint16_t eepromAddr, const uint16_t remaining) {
+  const uint16_t pageLeft = TargetConfig::EEPROM_PAGE_SIZE - (eepromAddr % TargetConfig::EEPROM_PAGE_SIZE);
+  return Util::min(remaining, pageLeft);
+}
+
+Util::Status NVM::EEPROM::read(const uint16_t eepromAddr, uint8_t * const buffer, const uint16_t len) {
+  const Util::Status rangeStatus = checkEEPROMRange(eepromAddr, len);
+  if (rangeStatus != Util::Status::OK) { return rangeStatus; }
+  return NVM::read(TargetConfig::EEPROM_START + eepromAddr, buffer, len);
+}
+
+Util::Status NVM::EEPROM::erase(const uint16_t eepromAddr, const uint16_t len) {
+  using NVM::Controller::Cmd;
+
+  const Util::Status rangeStatus = checkEEPROMRange(eepromAddr, len);
+  if (rangeStatus != Util::Status::OK) { return rangeStatus; }
+
+  if (eepromAddr == 0 && len == ch->device.eepromSize) {
+    const Util::Status status = NVM::Controller::waitWhileBusy();
+    if (status != Util::Status::OK) { return status; }
+    NVM::Controller::execCmd(Cmd::ERASEEEPROM);
+    started(Op::SECTION_ERASE);
+    return Util::Status::OK;
+  }
+
+  uint8_t erased[TargetConfig::EEPROM_PAGE_SIZE];
+  for (uint16_t i = 0; i < TargetConfig::EEPROM_PAGE_SIZE; i++) {
+    erased[i] = 0xFF;
+  }
+
+  uint16_t currAddr = eepromAddr;
+  uint16_t remaining = len;
+  while (remaining) {
+    const uint16_t chunkLen = eepromChunkLen(currAddr, remaining);
+    const uint32_t addr = TargetConfig::EEPROM_START + currAddr;
+    Util::Status status = loadEEPROMBuffer(addr, erased, chunkLen);
+    if (status != Util::Status::OK) { return status; }
+    status = commitEEPROMPage(Cmd::ERASEEEPROMPAGE, addr, Op::PAGE_ERASE);
+    if (status != Util::Status::OK) { return status; }
+    currAddr += chunkLen;
+    remaining -= chunkLen;
+  }
+  return Util::Status::OK;
+}
+
+Util::Status NVM::EEPROM::write(const uint16_t eepromAddr, const Util::ByteProviderCallback callback, const Util::AbortCallback aborted, const uint16_t len) {
+  const Util::Status rangeStatus = checkEEPROMRange(eepromAddr, len);
+  if (rangeStatus != Util::Status::OK) { return rangeStatus; }
+
+  uint8_t data[TargetConfig::EEPROM_PAGE_SIZE];
+  uint8_t current[TargetConfig::EEPROM_PAGE_SIZE];
+
+  uint16_t currAddr = eepromAddr;
+  uint16_t remaining = len;
+  while (remaining) {
+    const uint16_t chunkLen = eepromChunkLen(currAddr, remaining);
+    for (uint16_t i = 0; i < chunkLen; i++) {
+      data[i] = callback();
+    }
+    if (aborted()) { return Util::Status::ABORTED; }
+
+    // An erase-write costs several milliseconds; reading the page back first
+    // costs far less.
+    const uint32_t addr = TargetConfig::EEPROM_START + currAddr;
+    Util::Status status = NVM::read(addr, current, chunkLen);
+    if (status != Util::Status::OK) { return status; }
+    bool unchanged = true;
+    for (uint16_t i = 0; i < chunkLen; i++) {
+      if (current[i] != data[i]) {
+        unchanged = false;
+        break;
+      }
+    }
+
+    if (unchanged) {
+      unchangedEEPROMPageCount++;
+    } else {
+      status = loadEEPROMBuffer(addr, data, chunkLen);
+      if (status != Util::Status::OK) { return status; }
+      status = commitEEPROMPage(NVM::Controller::Cmd::ERASEWRITEEEPROMPAGE, addr, Op::PAGE_ERASE_WRITE);
+      if (status != Util::Status::OK) { return status; }
+    }
+    currAddr += chunkLen;
+    remaining -= chunkLen;
+  }
+  return Util::Status::OK;
+}
+
+uint16_t NVM::EEPROM::unchangedPages() {
+  return unchangedEEPROMPageCount;
+}
+
+Util::Status NVM::UserSig::write(const uint8_t * const data, const uint16_t len) {
+  using NVM::Controller::Cmd;
+
+  Util::Status status = NVM::identify();
+  if (status != Util::Status::OK) { return status; }
+  if (len > ch->device.userSigSize()) { return Util::Status::INVALID_LENGTH; }
+
+  status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return status; }
+
+  // Both commands are triggered by a write to the row.
+  NVM::Controller::writeCmd(Cmd::ERASEUSERSIG);
+  PDI::Instruction::sts41(TargetConfig::USER_SIG_START, 0);
+  started(Op::PAGE_ERASE);
+
+  // The row is written from the flash page buffer.
+  status = ensurePageBufferClean();
+  if (status != Util::Status::OK) { return status; }
+  status = NVM::Flash::writeBuffer(0, data, len);
+  if (status != Util::Status::OK) { return status; }
+
+  status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return status; }
+
+  NVM::Controller::writeCmd(Cmd::WRITEUSERSIG);
+  PDI::Instruction::sts41(TargetConfig::USER_SIG_START, 0);
+  started(Op::PAGE_WRITE);
+  ch->pageBufferDirty = false;
+  return Util::Status::OK;
+}
+
+static Util::MaybeUint8 readFuseOnce(const uint8_t fuseAddr) {
+  using NVM::Controller::Reg;
+
+  Util::Status status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return Util::MaybeUint8(status); }
+
+  NVM::Controller::writeReg(Reg::ADDR0, fuseAddr);
+  NVM::Controller::writeReg(Reg::ADDR1, 0);
+  NVM::Controller::writeReg(Reg::ADDR2, 0);
+  NVM::Controller::execCmd(NVM::Controller::Cmd::READFUSE);
+
+  status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return Util::MaybeUint8(status); }
+  return NVM::Controller::readReg(Reg::DATA0);
+}
+
+Util::MaybeUint8 NVM::Fuse::read(const uint8_t fuseAddr) {
+  for (uint8_t retry = 0; ; retry++) {
+    const Util::MaybeUint8 result = readFuseOnce(fuseAddr);
+    if (!retryable(result.status)) { return result; }
+    relink();
+    if (retry == RETRIES) { return result; }
+    Stats::count(Stats::Counter::RETRIES);
+  }
+}
+
 Util::Status NVM::Fuse::write(const uint8_t fuseAddr, const uint8_t data) {
   const uint32_t addr = TargetConfig::FUSE_START + ((uint32_t) fuseAddr);
 
@@ -275,5 +1297,59 @@ Util::Status NVM::Fuse::write(const uint8_t fuseAddr, const uint8_t data) {
 
   NVM::Controller::writeCmd(NVM::Controller::Cmd::WRITEFUSE);
   PDI::Instruction::sts41(addr, data);
+  started(Op::FUSE_WRITE);
+  return Util::Status::OK;
+}
+
+Util::MaybeUint8 NVM::Fuse::readLock() {
+  uint8_t data;
+  const Util::Status status = NVM::read(TargetConfig::LOCK_BITS_ADDR, &data, 1);
+  return Util::MaybeUint8(status, data);
+}
+
+Util::Status NVM::Fuse::writeLock(const uint8_t data) {
+  const Util::Status status = NVM::Controller::waitWhileBusy();
+  if (status != Util::Status::OK) { return status; }
+
+  NVM::Controller::writeCmd(NVM::Controller::Cmd::WRITELOCK);
+  PDI::Instruction::sts41(TargetConfig::LOCK_BITS_ADDR, data);
+  started(Op::FUSE_WRITE);
   return Util::Status::OK;
 }
+
+Util::Status NVM::Fuse::update(const uint8_t mask, const uint8_t * const values, uint8_t * const previous, uint8_t * const written) {
+  *written = 0;
+
+  // Each write costs an NVM busy cycle; a read costs a few PDI instructions.
+  uint8_t n = 0;
+  for (uint8_t fuse = 0; fuse < TargetConfig::FUSE_COUNT; fuse++) {
+    if (!(mask & (1 << fuse))) { continue; }
+    const Util::MaybeUint8 current = NVM::Fuse::read(fuse);
+    if (!current.ok()) { return current.status; }
+    previous[n++] = current.data;
+  }
+  if (mask & LOCK_MASK) {
+    const Util::MaybeUint8 current = NVM::Fuse::readLock();
+    if (!current.ok()) { return current.status; }
+    if (values[n] & ~current.data) { return Util::Status::LOCKED; }
+    previous[n] = current.data;
+  }
+
+  n = 0;
+  for (uint8_t fuse = 0; fuse < TargetConfig::FUSE_COUNT; fuse++) {
+    if (!(mask & (1 << fuse))) { continue; }
+    if (values[n] != previous[n]) {
+      const Util::Status status = NVM::Fuse::write(fuse, values[n]);
+      if (status != Util::Status::OK) { return status; }
+      *written |= 1 << fuse;
+    }
+    n++;
+  }
+  // Locking may shut the PDI out of the memories, so it goes last.
+  if ((mask & LOCK_MASK) && values[n] != previous[n]) {
+    const Util::Status status = NVM::Fuse::writeLock(values[n]);
+    if (status != Util::Status::OK) { return status; }
+    *written |= LOCK_MASK;
+  }
+  return NVM::Controller::waitWhileBusy();
+}
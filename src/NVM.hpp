@@ -4,16 +4,42 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "TargetConfig.hpp"
 #include "Util.hpp"
 
 namespace NVM {
   void init();
+  // Attach to the target, then raise the PDI clock and shorten the guard time
+  // as far as the link reliably allows.
   void begin();
   void end();
   bool active();
 
+  // PDI channels (see PDI::select). Everything else applies to the target on
+  // the selected channel, and each channel may be attached or not.
+  uint8_t channels();
+  void select(const uint8_t channel);
+  uint8_t selected();
+
+  // Look the target's signature (MCU.DEVID0-2) up in TargetConfig::DEVICES.
+  // This is done on attach, and again by any operation that depends on the
+  // sizes of the target's memories until it succeeds. Fails with
+  // Status::UNKNOWN_DEVICE for a device not in the table, and so do those
+  // operations.
+  Util::Status identify();
+  // The device identified, with an id of 0 if none has been.
+  const TargetConfig::Device & device();
+  // The signature as read, or zeros if it could not be.
+  const uint8_t * signature();
+
   namespace Controller {
     enum class Reg : uint8_t {
+      ADDR0 = 0x00,
+      ADDR1 = 0x01,
+      ADDR2 = 0x02,
+      DATA0 = 0x04,
+      DATA1 = 0x05,
+      DATA2 = 0x06,
       CMD = 0x0A,
       CTRLA = 0x0B,
       STATUS = 0x0F,
@@ -56,6 +82,7 @@ namespace NVM {
     };
 
     uint32_t regAddr(const Reg reg);
+    Util::MaybeUint8 readReg(const Reg reg);
     void writeReg(const Reg reg, const uint8_t data);
     void writeCmd(const Cmd cmd);
     void writeCmdex();
@@ -68,6 +95,9 @@ namespace NVM {
 
   Util::Status eraseChip();
 
+  // The programmer keeps track of the flash pages known to be erased since
+  // NVM::begin(), from erasing them or reading them back blank. Erasing them
+  // again is left out, and a pre-erasing write of one becomes a plain write.
   namespace Flash {
     enum class Section : uint8_t {
       UNSPECIFIED,
@@ -75,17 +105,82 @@ namespace NVM {
       BOOT,
     };
 
+    Util::Status read(const uint32_t flashAddr, uint8_t * const buffer, const uint16_t len, const Section section = Section::UNSPECIFIED);
     Util::Status eraseSection(const uint32_t flashAddr, const Section section);
     Util::Status eraseBuffer();
     Util::Status writeBuffer(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const NVM::Flash::Section section = Section::UNSPECIFIED);
+    Util::Status writeBuffer(const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const NVM::Flash::Section section = Section::UNSPECIFIED);
     Util::Status erasePage(const uint32_t flashAddr, const Section section = Section::UNSPECIFIED);
     Util::Status writePageFromBuffer(const uint32_t flashAddr, const bool preErase = false, const Section section = Section::UNSPECIFIED);
     Util::Status writePage(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const bool preErase = false, const Section section = Section::UNSPECIFIED);
-    Util::Status write(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const uint16_t len, const bool preErase = false, const Section section = Section::UNSPECIFIED);
+    Util::Status writePage(const uint32_t flashAddr, const uint8_t * const data, const uint16_t len, const bool preErase = false, const Section section = Section::UNSPECIFIED);
+    // Bytes are staged a page at a time. `tryCallback` is used to fetch the
+    // next page while the target is busy with the current one. Pages that are
+    // entirely 0xFF are not written, and with `preErase` only erased. Once
+    // `aborted` returns true no more pages are written, and the result is
+    // Status::ABORTED.
+    Util::Status write(const uint32_t flashAddr, const Util::ByteProviderCallback callback, const Util::ByteTryProviderCallback tryCallback, const Util::AbortCallback aborted, const uint16_t len, const bool preErase = false, const Section section = Section::UNSPECIFIED);
+    // write() to each of the channels in the bit mask `targets`, which must
+    // all be active, loading a page into one target while the others commit
+    // theirs. A target that is not the same device as the first fails with
+    // Status::DEVICE_MISMATCH before anything is written to it. A page that
+    // fails because of the link is retried after getting the link going
+    // again. A target that still fails is dropped and set in `failed`, and the
+    // status of the last failure returned. `failedAddr` is the address of the
+    // first page that failed, or NO_FAILURE. All `len` bytes are taken from
+    // `callback` whatever happens. The selected channel is left as it was.
+    static constexpr uint32_t NO_FAILURE = 0xFFFFFFFF;
+    Util::Status writeTargets(const uint8_t targets, const uint32_t flashAddr, const Util::ByteProviderCallback callback, const Util::ByteTryProviderCallback tryCallback, const Util::AbortCallback aborted, const uint16_t len, const bool preErase, const Section section, uint8_t * const failed, uint32_t * const failedAddr);
+    // Number of all-0xFF pages write() has skipped since NVM::begin(), each
+    // counted once however many targets it was for.
+    uint16_t skippedPages();
+
+    // Have the target compute the CRC of a section (or of the whole flash, for
+    // Section::UNSPECIFIED).
+    Util::MaybeUint32 crc(const Section section);
+    // The CRC the APP or BOOT section should have, given everything written
+    // through write() since the section (or chip) was last erased. Fails with
+    // Status::INVALID_SECTION if this is not known.
+    Util::MaybeUint32 expectedCrc(const Section section);
+    // Stop assuming that any page of `section` is erased, for when its CRC
+    // shows our record of it to be wrong.
+    void forgetErased(const Section section);
+  }
+
+  // Addresses are offsets from the start of the EEPROM.
+  namespace EEPROM {
+    Util::Status read(const uint16_t eepromAddr, uint8_t * const buffer, const uint16_t len);
+    Util::Status erase(const uint16_t eepromAddr, const uint16_t len);
+    // Bytes are taken a page at a time, and each page is only written if the
+    // EEPROM does not already hold them. As for Flash::write(), nothing more
+    // is written once `aborted` returns true.
+    Util::Status write(const uint16_t eepromAddr, const Util::ByteProviderCallback callback, const Util::AbortCallback aborted, const uint16_t len);
+    // Number of pages write() has left alone since NVM::begin().
+    uint16_t unchangedPages();
+  }
+
+  namespace UserSig {
+    // Erase the user signature row and write `len` bytes of `data` to the
+    // start of it.
+    Util::Status write(const uint8_t * const data, const uint16_t len);
   }
 
   namespace Fuse {
+    Util::MaybeUint8 read(const uint8_t fuseAddr);
     Util::Status write(const uint8_t fuseAddr, const uint8_t data);
+    Util::MaybeUint8 readLock();
+    // Lock bits can only be programmed (cleared) this way.
+    Util::Status writeLock(const uint8_t data);
+
+    // Bit n of a mask stands for fuse byte n, and LOCK_MASK for the lock bits.
+    static constexpr uint8_t LOCK_MASK = 0x80;
+    // Write each of the bytes in `mask` that does not already hold its value,
+    // the lock bits last. `values` and `previous`, which gets what the bytes
+    // held, are in mask bit order with one entry for each byte in `mask`.
+    // `written` gets the mask of the bytes written. Fails with
+    // Status::LOCKED, having written nothing, if a lock bit would have to be
+    // unprogrammed, which only a chip erase does.
+    Util::Status update(const uint8_t mask, const uint8_t * const values, uint8_t * const previous, uint8_t * const written);
   }
 }
 
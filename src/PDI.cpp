@@ -7,6 +7,7 @@
 #include "PDI.hpp"
 #include "PDIPin.hpp"
 #include "Platform.hpp"
+#include "Stats.hpp"
 #include "Util.hpp"
 
 enum class Mode : uint8_t {
@@ -15,18 +16,65 @@ enum class Mode : uint8_t {
   RECEIVING,
 };
 
+// The USART, and so the direction it is set up for, is shared by all channels.
 static Mode mode = Mode::NEITHER;
 
-static void waitForClockCycle() {
-  while (Platform::Pin::read(PDIPin::CLK)) {}
-  while (!Platform::Pin::read(PDIPin::CLK)) {}
-  while (Platform::Pin::read(PDIPin::CLK)) {}
+class LinkState {
+public:
+  bool attached;
+  uint32_t clock;
+  // Platform::Timer ticks in a clock cycle and in TIMEOUT_CYCLES, rounded up.
+  uint16_t cycleTicks;
+  uint32_t timeoutTicks;
+  PDI::GuardTime guardTime;
+  // Shadow of the target's PDI pointer register, so that it need not be
+  // reloaded when it already holds the right address.
+  bool pointerKnown;
+  uint32_t pointer;
+};
+
+static LinkState channelStates[Platform::TargetSerial::MAX_CHANNELS];
+static uint8_t selectedChannel = 0;
+static LinkState * ch = &channelStates[0];
+
+static void advancePointer(const PDI::PtrMode pm, const uint16_t count) {
+  if (pm == PDI::PtrMode::INDIRECT_INCR) {
+    ch->pointer += count;
+  }
+}
+
+// The clock is shared, so it must keep running while any target is attached.
+static bool anyAttached() {
+  for (uint8_t i = 0; i < Platform::TargetSerial::MAX_CHANNELS; i++) {
+    if (channelStates[i].attached) { return true; }
+  }
+  return false;
+}
+
+static void setClockTicks(LinkState * const state) {
+  static constexpr uint32_t TICK_HZ = Platform::Timer::TICK_HZ;
+
+  state->cycleTicks = (TICK_HZ + state->clock - 1) / state->clock;
+  state->timeoutTicks = (PDI::TIMEOUT_CYCLES * TICK_HZ + state->clock - 1) / state->clock;
+}
+
+// Whether more than `ticks` timer ticks have passed since `start`. The tick
+// in progress at `start` may have been nearly over, so it does not count.
+static bool ticksPassed(const uint32_t start, const uint32_t ticks) {
+  return Platform::Timer::ticks() - start > ticks;
+}
+
+// Wait for at least `cycles` cycles of the selected channel's clock.
+static void waitForClockCycles(const uint8_t cycles) {
+  const uint32_t start = Platform::Timer::ticks();
+  const uint32_t ticks = (uint32_t) cycles * ch->cycleTicks;
+  while (!ticksPassed(start, ticks)) {}
 }
 
 static void ensureTransmitMode() {
   if (mode != Mode::TRANSMITTING) {
-    // Wait for a clock cycle.
-    waitForClockCycle();
+    // Give the target a clock cycle to let go of the data line.
+    waitForClockCycles(1);
 
     Platform::Pin::configureAsOutput(PDIPin::TXD, true);
 
@@ -34,6 +82,7 @@ static void ensureTransmitMode() {
     Platform::TargetSerial::disableRx();
 
     mode = Mode::TRANSMITTING;
+    Stats::count(Stats::Counter::DIRECTION_SWITCHES);
   }
 }
 
@@ -49,21 +98,36 @@ static void ensureReceiveMode() {
     Platform::Pin::configureAsInput(PDIPin::TXD);
 
     mode = Mode::RECEIVING;
+    Stats::count(Stats::Counter::DIRECTION_SWITCHES);
   }
 }
 
 void PDI::init() {
   mode = Mode::NEITHER;
+  for (uint8_t i = 0; i < Platform::TargetSerial::MAX_CHANNELS; i++) {
+    channelStates[i].attached = false;
+    channelStates[i].clock = PDI::BAUD_RATE;
+    setClockTicks(&channelStates[i]);
+    channelStates[i].guardTime = PDI::GuardTime::_128;
+    channelStates[i].pointerKnown = false;
+  }
+  selectedChannel = 0;
+  ch = &channelStates[0];
 
   // Configure initial pin modes and states.
   Platform::Pin::configureAsInput(PDIPin::CLK);
   Platform::Pin::configureAsInput(PDIPin::TXD);
   Platform::Pin::configureAsInput(PDIPin::RXD);
   Platform::TargetSerial::init();
+  PDI::setClock(PDI::BAUD_RATE);
 }
 
 void PDI::begin() {
-  Platform::Pin::configureAsOutput(PDIPin::CLK, true);
+  if (!anyAttached()) {
+    Platform::Pin::configureAsOutput(PDIPin::CLK, true);
+  }
+  // Transmitting with the receiver on would fill it with our own frames.
+  Platform::TargetSerial::disableRx();
   Platform::Pin::configureAsOutput(PDIPin::TXD, false);
   _delay_us(100);
 
@@ -71,19 +135,24 @@ void PDI::begin() {
   _delay_us(20);
 
   mode = Mode::TRANSMITTING;
+  ch->pointerKnown = false;
+  ch->attached = true;
   Platform::TargetSerial::enableClock();
   Platform::TargetSerial::enableTx();
 
   // Minimum 16 clock cycles.
-  for (uint8_t i = 0; i < 18; i++) {
-    waitForClockCycle();
-  }
+  waitForClockCycles(18);
 }
 
 void PDI::end() {
   // Switch to receiving mode to ensure all pending transmissions are complete.
   ensureReceiveMode();
 
+  ch->pointerKnown = false;
+  ch->attached = false;
+  // The data line is now tri-stated. Leave the rest for the other targets.
+  if (anyAttached()) { return; }
+
   // Turn off UART.
   Platform::TargetSerial::disableRx();
   Platform::TargetSerial::disableTx();
@@ -94,6 +163,48 @@ void PDI::end() {
   Platform::Pin::configureAsInput(PDIPin::CLK);
   Platform::Pin::configureAsInput(PDIPin::TXD);
   Platform::Pin::configureAsInput(PDIPin::RXD);
+  mode = Mode::NEITHER;
+}
+
+uint8_t PDI::channels() {
+  return Platform::TargetSerial::channels();
+}
+
+void PDI::select(const uint8_t channel) {
+  if (channel == selectedChannel) { return; }
+
+  // Let the last frame reach its target before the data line is switched,
+  // and make sure nothing from that target is taken as coming from the next.
+  if (mode == Mode::TRANSMITTING) {
+    ensureReceiveMode();
+  }
+  Platform::TargetSerial::disableRx();
+  Platform::TargetSerial::select(channel);
+  selectedChannel = channel;
+  ch = &channelStates[channel];
+  if (ch->attached) {
+    Platform::TargetSerial::setBaudRate(ch->clock);
+  }
+  if (mode == Mode::RECEIVING) {
+    Platform::TargetSerial::enableRx();
+  }
+}
+
+uint8_t PDI::selected() {
+  return selectedChannel;
+}
+
+void PDI::setClock(const uint32_t baud) {
+  // Let any frame in progress finish at the old rate.
+  if (mode == Mode::TRANSMITTING) {
+    while (!Platform::TargetSerial::txComplete()) {}
+  }
+  ch->clock = Platform::TargetSerial::setBaudRate(baud);
+  setClockTicks(ch);
+}
+
+uint32_t PDI::clock() {
+  return ch->clock;
 }
 
 void PDI::Link::send(const uint8_t byte) {
@@ -102,6 +213,7 @@ void PDI::Link::send(const uint8_t byte) {
   while (!Platform::TargetSerial::txBufferEmpty()) {}
   Platform::TargetSerial::resetTxComplete();
   Platform::TargetSerial::writeData(byte);
+  Stats::count(Stats::Counter::BYTES_SENT);
 }
 
 void PDI::Link::send2(const uint16_t word) {
@@ -118,27 +230,104 @@ void PDI::Link::send4(const uint32_t word) {
   PDI::Link::send(bytes[3]);
 }
 
+void PDI::Link::sendBuffer(const uint8_t * const data, const uint16_t len) {
+  if (len == 0) { return; }
+  ensureTransmitMode();
+
+  // Keep the USART's transmit buffer topped up so that frames go out back to
+  // back. TXC only needs clearing once the last byte is queued.
+  const uint16_t last = len - 1;
+  for (uint16_t i = 0; i < last; i++) {
+    while (!Platform::TargetSerial::txBufferEmpty()) {}
+    Platform::TargetSerial::writeData(data[i]);
+  }
+  while (!Platform::TargetSerial::txBufferEmpty()) {}
+  Platform::TargetSerial::resetTxComplete();
+  Platform::TargetSerial::writeData(data[last]);
+  Stats::count(Stats::Counter::BYTES_SENT, len);
+}
+
 static Util::MaybeUint8 getReceivedFrame() {
   if (Platform::TargetSerial::rxError()) {
+    // Reading the data register discards the bad frame.
+    Platform::TargetSerial::readData();
+    Stats::count(Stats::Counter::SERIAL_ERRORS);
     return Util::MaybeUint8(Util::Status::SERIAL_ERROR);
   } else {
     const uint8_t data = Platform::TargetSerial::readData();
+    Stats::count(Stats::Counter::BYTES_RECEIVED);
     return Util::MaybeUint8(Util::Status::OK, data);
   }
 }
 
+void PDI::sendBreak() {
+  // A BREAK is at least 12 clock cycles with the data line low. The clock
+  // keeps running in receive mode, so drive the line by hand from there.
+  static constexpr uint8_t BREAK_CYCLES = 2 * 12 + 2;
+
+  ensureReceiveMode();
+  ch->pointerKnown = false;
+  Platform::Pin::configureAsOutput(PDIPin::TXD, false);
+  waitForClockCycles(BREAK_CYCLES);
+  Platform::Pin::write(PDIPin::TXD, true);
+  waitForClockCycles(1);
+  Platform::Pin::configureAsInput(PDIPin::TXD);
+
+  // Discard anything received while the line was held low.
+  while (Platform::TargetSerial::rxComplete()) {
+    getReceivedFrame();
+  }
+}
+
 Util::MaybeUint8 PDI::Link::recv() {
   ensureReceiveMode();
 
-  for (uint16_t i = 0; i < PDI::TIMEOUT_CYCLES; i++) {
-    if (Platform::TargetSerial::rxComplete()) {
-      return getReceivedFrame();
+  // The timer is only read once a frame is found not to be waiting already.
+  if (!Platform::TargetSerial::rxComplete()) {
+    const uint32_t start = Platform::Timer::ticks();
+    while (true) {
+      // Look at the time first: if we were held up past the timeout (by an
+      // interrupt, say), a frame that arrived meanwhile still counts.
+      const bool expired = ticksPassed(start, ch->timeoutTicks);
+      if (Platform::TargetSerial::rxComplete()) { break; }
+      if (expired) {
+        // TIMEOUT_CYCLES clock cycles passed without a frame being received.
+        ch->pointerKnown = false;
+        Stats::count(Stats::Counter::TIMEOUTS);
+        return Util::MaybeUint8(Util::Status::SERIAL_TIMEOUT);
+      }
     }
-    waitForClockCycle();
   }
 
-  // TIMEOUT_CYCLES clock cycles passed without a frame being received.
-  return Util::MaybeUint8(Util::Status::SERIAL_TIMEOUT);
+  const Util::MaybeUint8 result = getReceivedFrame();
+  if (!result.ok()) {
+    // We can no longer be sure what the target has executed.
+    ch->pointerKnown = false;
+  }
+  return result;
+}
+
+Util::Status PDI::Link::recvBuffer(uint8_t * const buffer, const uint16_t len) {
+  ensureReceiveMode();
+
+  uint16_t direct = 0;
+  for (uint16_t i = 0; i < len; i++) {
+    // Take frames that are already waiting directly; anything else goes the
+    // long way round, with its timeout and error handling.
+    if (Platform::TargetSerial::rxComplete() && !Platform::TargetSerial::rxError()) {
+      buffer[i] = Platform::TargetSerial::readData();
+      direct++;
+    } else {
+      const Util::MaybeUint8 result = PDI::Link::recv();
+      if (!result.ok()) {
+        Stats::count(Stats::Counter::BYTES_RECEIVED, direct);
+        return result.status;
+      }
+      buffer[i] = result.data;
+    }
+  }
+  Stats::count(Stats::Counter::BYTES_RECEIVED, direct);
+  return Util::Status::OK;
 }
 
 Util::MaybeUint8 PDI::Instruction::lds41(const uint32_t addr) {
@@ -156,10 +345,31 @@ void PDI::Instruction::sts41(const uint32_t addr, const uint8_t data) {
 Util::MaybeUint8 PDI::Instruction::ld1(const PDI::PtrMode pm) {
   const uint8_t pmMask = ((uint8_t) pm) & 0xC;
   PDI::Link::send(0x20 | pmMask);
+  advancePointer(pm, 1);
   return PDI::Link::recv();
 }
 
-Util::Status PDI::Instruction::bulkLd12(const PDI::PtrMode pm, uint8_t * const buffer, const uint16_t len) {
+Util::MaybeUint32 PDI::Instruction::ldPtr() {
+  // LD with the pointer register itself as the operand, 4 bytes.
+  PDI::Link::send(0x2B);
+  union {
+    uint8_t bytes[4];
+    uint32_t word;
+  } u;
+  for (uint8_t i = 0; i < 4; i++) {
+    const Util::MaybeUint8 result = PDI::Link::recv();
+    if (!result.ok()) { return Util::MaybeUint32(result.status); }
+    u.bytes[i] = result.data;
+  }
+  return Util::MaybeUint32(Util::Status::OK, u.word);
+}
+
+void PDI::Instruction::setPointer(const uint32_t addr) {
+  if (ch->pointerKnown && ch->pointer == addr) { return; }
+  PDI::Instruction::st4(PDI::PtrMode::DIRECT, addr);
+}
+
+Util::Status PDI::Instruction::bulkLd(const PDI::PtrMode pm, uint8_t * const buffer, const uint16_t len) {
   // Check for shortcuts.
   if (len == 0) { return Util::Status::OK; }
   if (len == 1) {
@@ -174,31 +384,33 @@ Util::Status PDI::Instruction::bulkLd12(const PDI::PtrMode pm, uint8_t * const b
   // Send the LD instruction byte.
   const uint8_t pmMask = ((uint8_t) pm) & 0xC;
   PDI::Link::send(0x20 | pmMask);
+  advancePointer(pm, len);
   // The target device executes LD `len` times, responding with the same number
   // of bytes.
-  for (uint16_t i = 0; i < len; i++) {
-    Util::MaybeUint8 result = PDI::Link::recv();
-    if (!result.ok()) { return result.status; }
-    buffer[i] = result.data;
-  }
-  return Util::Status::OK;
+  return PDI::Link::recvBuffer(buffer, len);
 }
 
 void PDI::Instruction::st1(const PDI::PtrMode pm, const uint8_t data) {
   const uint8_t pmMask = ((uint8_t) pm) & 0xC;
   PDI::Link::send(0x60 | pmMask);
   PDI::Link::send(data);
+  advancePointer(pm, 1);
 }
 
 void PDI::Instruction::st4(const PDI::PtrMode pm, const uint32_t data) {
   const uint8_t pmMask = ((uint8_t) pm) & 0xC;
   PDI::Link::send(0x63 | pmMask);
   PDI::Link::send4(data);
+  if (pm == PDI::PtrMode::DIRECT) {
+    ch->pointerKnown = true;
+    ch->pointer = data;
+  } else {
+    advancePointer(pm, 4);
+  }
 }
 
-void PDI::Instruction::bulkSt12(const PDI::PtrMode pm, const Util::ByteProviderCallback callback, const uint16_t len) {
-  // Check for shortcuts.
-  if (len == 0) { return; }
+// Send the instructions for an ST of `len` bytes, which must follow.
+static void beginBulkSt(const PDI::PtrMode pm, const uint16_t len) {
   if (len != 1) {
     // Send the REPEAT instruction.
     // `len` cannot be 0, so `len - 1` cannot underflow.
@@ -207,11 +419,31 @@ void PDI::Instruction::bulkSt12(const PDI::PtrMode pm, const Util::ByteProviderC
   // Send the ST instruction byte.
   const uint8_t pmMask = ((uint8_t) pm) & 0xC;
   PDI::Link::send(0x60 | pmMask);
+  advancePointer(pm, len);
+}
+
+void PDI::Instruction::bulkSt(const PDI::PtrMode pm, const uint8_t * const data, const uint16_t len) {
+  if (len == 0) { return; }
+  beginBulkSt(pm, len);
   // The target device executes ST `len` times, accepting the same number of
   // bytes.
-  for (uint16_t i = 0; i < len; i++) {
-    const uint8_t byte = callback();
-    PDI::Link::send(byte);
+  PDI::Link::sendBuffer(data, len);
+}
+
+void PDI::Instruction::bulkSt12(const PDI::PtrMode pm, const Util::ByteProviderCallback callback, const uint16_t len) {
+  static constexpr uint8_t CHUNK_SIZE = 16;
+  uint8_t chunk[CHUNK_SIZE];
+
+  if (len == 0) { return; }
+  beginBulkSt(pm, len);
+  uint16_t remaining = len;
+  while (remaining) {
+    const uint8_t chunkLen = Util::min(remaining, CHUNK_SIZE);
+    for (uint8_t i = 0; i < chunkLen; i++) {
+      chunk[i] = callback();
+    }
+    PDI::Link::sendBuffer(chunk, chunkLen);
+    remaining -= chunkLen;
   }
 }
 
@@ -269,4 +501,22 @@ Util::MaybeBool PDI::inResetState() {
 void PDI::setGuardTime(const PDI::GuardTime gt) {
   const uint8_t data = ((uint8_t) gt) & 0x7;
   PDI::Instruction::stcs(PDI::CSReg::CTRL, data);
+  ch->guardTime = gt;
+}
+
+#ifdef PDIPROG_CHECK_SHADOW
+Util::Status PDI::checkShadow() {
+  if (!ch->pointerKnown) { return Util::Status::OK; }
+  const Util::MaybeUint32 result = PDI::Instruction::ldPtr();
+  if (!result.ok()) { return result.status; }
+  if (result.data != ch->pointer) {
+    ch->pointerKnown = false;
+    return Util::Status::SHADOW_MISMATCH;
+  }
+  return Util::Status::OK;
+}
+#endif
+
+PDI::GuardTime PDI::guardTime() {
+  return ch->guardTime;
 }
@@ -7,18 +7,43 @@
 #include "Util.hpp"
 
 namespace PDI {
+  // Clock rate used when attaching, before calibration.
   static constexpr uint32_t BAUD_RATE = 2000000;
+  // The fastest clock the USART can generate in synchronous mode. Whether
+  // the link keeps up at that rate is left to calibration.
+  static constexpr uint32_t MAX_BAUD_RATE = F_CPU / 2;
+  // How long to wait for a frame from the target, timed with Platform::Timer.
   static constexpr uint16_t TIMEOUT_CYCLES = 1024;
 
   void init();
   void begin();
   void end();
 
+  // Everything else applies to the selected channel (see
+  // Platform::TargetSerial). Each channel keeps its own clock rate, guard time
+  // and cached target state, and any number may be attached at once.
+  uint8_t channels();
+  void select(const uint8_t channel);
+  uint8_t selected();
+
+  // Change the clock rate. May be called while attached. The actual rate is
+  // the fastest supported by the platform that does not exceed `baud`.
+  void setClock(const uint32_t baud);
+  uint32_t clock();
+
+  // Send a double BREAK, returning the target's PDI from an error state to
+  // idle.
+  void sendBreak();
+
   namespace Link {
     void send(const uint8_t byte);
     void send2(const uint16_t word);
     void send4(const uint32_t word);
     Util::MaybeUint8 recv();
+    // Burst variants of send() and recv(), which keep the USART busy without
+    // going through them for every byte.
+    void sendBuffer(const uint8_t * const data, const uint16_t len);
+    Util::Status recvBuffer(uint8_t * const buffer, const uint16_t len);
   }
 
   enum class PtrMode : uint8_t {
@@ -38,9 +63,15 @@ namespace PDI {
     void sts41(const uint32_t addr, const uint8_t data);
 
     Util::MaybeUint8 ld1(const PtrMode pm);
-    Util::Status bulkLd12(const PtrMode pm, uint8_t * const buffer, const uint16_t len);
+    // Read the pointer register itself.
+    Util::MaybeUint32 ldPtr();
+    // Load the pointer register, unless it is known to hold `addr` already.
+    void setPointer(const uint32_t addr);
+    Util::Status bulkLd(const PtrMode pm, uint8_t * const buffer, const uint16_t len);
     void st1(const PtrMode pm, const uint8_t data);
     void st4(const PtrMode pm, const uint32_t data);
+    void bulkSt(const PtrMode pm, const uint8_t * const data, const uint16_t len);
+    // bulkSt() with the bytes taken from `callback`, a chunk at a time.
     void bulkSt12(const PtrMode pm, const Util::ByteProviderCallback callback, const uint16_t len);
 
     Util::MaybeUint8 ldcs(const CSReg reg);
@@ -65,6 +96,13 @@ namespace PDI {
   void exitResetState();
   Util::MaybeBool inResetState();
   void setGuardTime(const GuardTime gt);
+  GuardTime guardTime();
+
+#ifdef PDIPROG_CHECK_SHADOW
+  // Compare cached target state with the target, failing with
+  // Status::SHADOW_MISMATCH if they differ.
+  Util::Status checkShadow();
+#endif
 }
 
 #endif
@@ -6,6 +6,13 @@
 
 #include "PDIPin.hpp"
 
+// PDI channels the firmware is built for; per-channel state is sized by it.
+// Platforms with more than one set it in their vars.sh, and it can be
+// overridden with CC_FLAGS.
+#ifndef PDIPROG_CHANNELS
+#define PDIPROG_CHANNELS 1
+#endif
+
 namespace Platform {
   namespace Pin {
     void configureAsOutput(PDIPin pin, bool initialState);
@@ -14,8 +21,22 @@ namespace Platform {
     bool read(PDIPin pin);
   }
 
+  // There may be several PDI channels, each leading to a target of its own.
+  // They share the USART and its clock, and only the data line is switched;
+  // everything else here concerns the selected channel.
   namespace TargetSerial {
+    static constexpr uint8_t MAX_CHANNELS = PDIPROG_CHANNELS;
+    static_assert(MAX_CHANNELS >= 1 && MAX_CHANNELS <= 8, "target masks are 8 bits wide");
+
     void init();
+    // Number of channels, at most MAX_CHANNELS. Channel 0 is selected after
+    // init().
+    uint8_t channels();
+    // Must only be called while no frame is being sent or received.
+    void select(uint8_t channel);
+    // Set the fastest clock rate not exceeding `baud`. Returns the actual
+    // rate.
+    uint32_t setBaudRate(uint32_t baud);
     void enableClock();
     void disableClock();
     void enableTx();
@@ -31,12 +52,30 @@ namespace Platform {
     uint8_t readData();
   }
 
+  // Interrupt-driven link to the host. Received bytes are buffered until read
+  // and transmitted bytes are buffered until the UART can take them, so
+  // neither direction stalls while the PDI link is busy.
   namespace ClientSerial {
+    void init(uint32_t baud);
+    // Take a received byte from the buffer. Returns false if it is empty.
+    bool tryRead(uint8_t * data);
+    // Queue a byte for transmission. Returns false if the buffer is full.
+    bool tryWrite(uint8_t data);
+    // Whether `baud` can be generated to within 2%.
+    bool baudRateSupported(uint32_t baud);
+    // Switch to a supported baud rate once all queued bytes have been sent.
+    // Anything received but not yet read is discarded.
+    void setBaudRate(uint32_t baud);
+    uint32_t baudRate();
+  }
+
+  // Free-running timer, for measuring how long things take.
+  namespace Timer {
+    static constexpr uint32_t TICK_HZ = F_CPU / 8;
+
     void init();
-    bool rxComplete();
-    bool txBufferEmpty();
-    void writeData(uint8_t data);
-    uint8_t readData();
+    // Ticks since init(). Wraps around, so only differences are meaningful.
+    uint32_t ticks();
   }
 }
 
@@ -0,0 +1,75 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "Platform.hpp"
+#include "Stats.hpp"
+
+static constexpr uint8_t COUNTERS = (uint8_t) Stats::Counter::COUNT;
+static constexpr uint8_t PHASES = (uint8_t) Stats::Phase::COUNT;
+
+static uint32_t counters[COUNTERS];
+
+class PhaseTimer {
+public:
+  bool running;
+  uint32_t startTicks;
+  uint32_t completions;
+  uint32_t totalTicks;
+  uint32_t maxTicks;
+};
+
+static PhaseTimer phases[PHASES];
+
+void Stats::reset() {
+  for (uint8_t i = 0; i < COUNTERS; i++) {
+    counters[i] = 0;
+  }
+  for (uint8_t i = 0; i < PHASES; i++) {
+    // A phase in progress still gets counted when it stops.
+    phases[i].completions = 0;
+    phases[i].totalTicks = 0;
+    phases[i].maxTicks = 0;
+  }
+}
+
+void Stats::count(const Stats::Counter counter, const uint16_t n) {
+  counters[(uint8_t) counter] += n;
+}
+
+uint32_t Stats::counter(const Stats::Counter counter) {
+  return counters[(uint8_t) counter];
+}
+
+void Stats::start(const Stats::Phase phase) {
+  PhaseTimer & timer = phases[(uint8_t) phase];
+  timer.running = true;
+  timer.startTicks = Platform::Timer::ticks();
+}
+
+void Stats::stop(const Stats::Phase phase) {
+  PhaseTimer & timer = phases[(uint8_t) phase];
+  if (!timer.running) { return; }
+  timer.running = false;
+  Stats::record(phase, Platform::Timer::ticks() - timer.startTicks);
+}
+
+void Stats::record(const Stats::Phase phase, const uint32_t ticks) {
+  PhaseTimer & timer = phases[(uint8_t) phase];
+  timer.completions++;
+  timer.totalTicks += ticks;
+  if (ticks > timer.maxTicks) {
+    timer.maxTicks = ticks;
+  }
+}
+
+uint32_t Stats::completions(const Stats::Phase phase) {
+  return phases[(uint8_t) phase].completions;
+}
+
+uint32_t Stats::totalTicks(const Stats::Phase phase) {
+  return phases[(uint8_t) phase].totalTicks;
+}
+
+uint32_t Stats::maxTicks(const Stats::Phase phase) {
+  return phases[(uint8_t) phase].maxTicks;
+}
@@ -0,0 +1,60 @@
+#ifndef __PDIPROG_STATS_HPP
+#define __PDIPROG_STATS_HPP
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Performance counters and phase timers, for finding out where programming
+// time goes. Everything accumulates until reset().
+namespace Stats {
+  enum class Counter : uint8_t {
+    // PDI frames.
+    BYTES_SENT,
+    BYTES_RECEIVED,
+    DIRECTION_SWITCHES,
+    TIMEOUTS,
+    SERIAL_ERRORS,
+    // Times the NVM controller was waited for, and status reads while waiting.
+    NVM_WAITS,
+    BUSY_POLLS,
+    // Reads and flash page writes tried again after a link error.
+    RETRIES,
+    // Flash erases left out because the pages were known to be erased.
+    ERASES_AVOIDED,
+    // Compressed flash data from the host, and the bytes it decoded to.
+    COMPRESSED_BYTES,
+    DECOMPRESSED_BYTES,
+    COUNT,
+  };
+
+  // Timed with Platform::Timer. NVM operations are timed from being started
+  // until they are seen to have finished.
+  enum class Phase : uint8_t {
+    ATTACH,
+    CHIP_ERASE,
+    SECTION_ERASE,
+    PAGE_LOAD,
+    PAGE_COMMIT,
+    FUSE_WRITE,
+    COUNT,
+  };
+
+  void reset();
+
+  void count(const Counter counter, const uint16_t n = 1);
+  uint32_t counter(const Counter counter);
+
+  void start(const Phase phase);
+  // Does nothing unless the phase has been started since it last stopped.
+  void stop(const Phase phase);
+  // Count a completion of `phase` timed by the caller, for phases that can be
+  // in progress on several targets at once.
+  void record(const Phase phase, const uint32_t ticks);
+  // Number of times the phase has completed, and its total and longest
+  // durations in timer ticks.
+  uint32_t completions(const Phase phase);
+  uint32_t totalTicks(const Phase phase);
+  uint32_t maxTicks(const Phase phase);
+}
+
+#endif
@@ -1,26 +1,119 @@
 #ifndef __PDIPROG_TARGET_CONFIG_HPP
 #define __PDIPROG_TARGET_CONFIG_HPP
 
-namespace TargetConfig {
-  static constexpr uint16_t FLASH_PAGE_SIZE = 512;
-  static constexpr uint32_t FLASH_APP_PAGES = 384;
-  static constexpr uint32_t FLASH_BOOT_PAGES = 16;
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <avr/pgmspace.h>
 
+namespace TargetConfig {
+  // The PDI address map is the same on every XMEGA; only the sizes of the
+  // memories differ (see Device).
   static constexpr uint32_t FLASH_START = 0x00800000;
   static constexpr uint32_t FLASH_APP_START = FLASH_START;
-  static constexpr uint32_t FLASH_BOOT_START = FLASH_APP_START + FLASH_APP_PAGES*FLASH_PAGE_SIZE;
 
   static constexpr uint16_t EEPROM_PAGE_SIZE = 32;
-  static constexpr uint32_t EEPROM_PAGES = 64;
-
   static constexpr uint32_t EEPROM_START = 0x008C0000;
 
+  static constexpr uint32_t USER_SIG_START = 0x008E0400;
+
   static constexpr uint32_t FUSE_START = 0x008F0020;
+  // FUSEBYTE0-5, although not every device has all of them.
+  static constexpr uint8_t FUSE_COUNT = 6;
+  static constexpr uint32_t LOCK_BITS_ADDR = 0x008F0027;
 
   static constexpr uint32_t RAM_START = 0x01000000;
+  static constexpr uint32_t SRAM_START = RAM_START + 0x2000;
 
   static constexpr uint32_t NVM_REGS_OFFSET = 0x01C0;
   static constexpr uint32_t NVM_REGS_START = RAM_START + NVM_REGS_OFFSET;
+
+  // MCU.DEVID0-2. DEVID0 is the manufacturer's code and the same on all.
+  static constexpr uint32_t DEVID_START = RAM_START + 0x0090;
+  static constexpr uint8_t DEVID_LEN = 3;
+  static constexpr uint8_t MANUFACTURER_ID = 0x1E;
+
+  static constexpr uint8_t log2(const uint32_t n) {
+    return (n <= 1) ? 0 : 1 + log2(n / 2);
+  }
+
+  // The memory sizes of one device. Flash pages are a power of two in size,
+  // held as a shift so that splitting addresses into pages never divides.
+  // The boot section follows the application section, and the user
+  // signature row is one flash page.
+  class Device {
+  public:
+    // DEVID1 and DEVID2, or 0 for a device that has not been identified.
+    uint16_t id;
+    uint8_t flashPageShift;
+    uint16_t appPages;
+    uint16_t bootPages;
+    uint16_t eepromSize;
+
+    Device() = default;
+    constexpr Device(const uint16_t id_, const uint16_t flashPageSize, const uint32_t appSize, const uint32_t bootSize, const uint16_t eepromSize_)
+      : id(id_), flashPageShift(log2(flashPageSize)), appPages(appSize / flashPageSize),
+        bootPages(bootSize / flashPageSize), eepromSize(eepromSize_) {}
+
+    constexpr uint16_t flashPageSize() const { return 1 << flashPageShift; }
+    constexpr uint16_t flashPages() const { return appPages + bootPages; }
+    constexpr uint32_t appSize() const { return ((uint32_t) appPages) << flashPageShift; }
+    constexpr uint32_t bootSize() const { return ((uint32_t) bootPages) << flashPageShift; }
+    constexpr uint32_t bootStart() const { return FLASH_APP_START + appSize(); }
+    constexpr uint16_t userSigSize() const { return flashPageSize(); }
+  };
+
+  static constexpr uint32_t KB = 1024;
+
+  // Looked up by NVM on attach, from program memory.
+  static constexpr Device DEVICES[] PROGMEM = {
+    //     id      page  application   boot   EEPROM
+    Device(0x964E, 256,   64 * KB,   4 * KB, 2048),   // ATxmega64A1(U)
+    Device(0x974C, 512,  128 * KB,   8 * KB, 2048),   // ATxmega128A1(U)
+    Device(0x974E, 512,  192 * KB,   8 * KB, 2048),   // ATxmega192A1
+    Device(0x9846, 512,  256 * KB,   8 * KB, 4096),   // ATxmega256A1
+    Device(0x9642, 256,   64 * KB,   4 * KB, 2048),   // ATxmega64A3(U)
+    Device(0x9742, 512,  128 * KB,   8 * KB, 2048),   // ATxmega128A3(U)
+    Device(0x9744, 512,  192 * KB,   8 * KB, 2048),   // ATxmega192A3(U)
+    Device(0x9842, 512,  256 * KB,   8 * KB, 4096),   // ATxmega256A3(U)
+    Device(0x9843, 512,  256 * KB,   8 * KB, 4096),   // ATxmega256A3B(U)
+    Device(0x9441, 256,   16 * KB,   4 * KB, 1024),   // ATxmega16A4(U)
+    Device(0x9541, 256,   32 * KB,   4 * KB, 1024),   // ATxmega32A4(U)
+    Device(0x9646, 256,   64 * KB,   4 * KB, 2048),   // ATxmega64A4U
+    Device(0x9746, 256,  128 * KB,   8 * KB, 2048),   // ATxmega128A4U
+    Device(0x964A, 256,   64 * KB,   4 * KB, 2048),   // ATxmega64D3
+    Device(0x9748, 512,  128 * KB,   8 * KB, 2048),   // ATxmega128D3
+    Device(0x9749, 512,  192 * KB,   8 * KB, 2048),   // ATxmega192D3
+    Device(0x9844, 512,  256 * KB,   8 * KB, 4096),   // ATxmega256D3
+    Device(0x9442, 256,   16 * KB,   4 * KB, 1024),   // ATxmega16D4
+    Device(0x9542, 256,   32 * KB,   4 * KB, 1024),   // ATxmega32D4
+    Device(0x9647, 256,   64 * KB,   4 * KB, 2048),   // ATxmega64D4
+    Device(0x9747, 256,  128 * KB,   8 * KB, 2048),   // ATxmega128D4
+    Device(0x9341, 128,    8 * KB,   2 * KB,  512),   // ATxmega8E5
+    Device(0x9445, 128,   16 * KB,   4 * KB,  512),   // ATxmega16E5
+    Device(0x954C, 128,   32 * KB,   4 * KB, 1024),   // ATxmega32E5
+  };
+  static constexpr uint8_t DEVICE_COUNT = sizeof(DEVICES) / sizeof(DEVICES[0]);
+
+  static constexpr uint16_t larger(const uint16_t x, const uint16_t y) {
+    return (x > y) ? x : y;
+  }
+
+  // The largest of each size, for buffers that must do for any device.
+  static constexpr uint16_t maxFlashPageSize(const uint8_t i = 0) {
+    return (i == DEVICE_COUNT) ? 0 : larger(DEVICES[i].flashPageSize(), maxFlashPageSize(i + 1));
+  }
+  static constexpr uint16_t maxFlashPages(const uint8_t i = 0) {
+    return (i == DEVICE_COUNT) ? 0 : larger(DEVICES[i].flashPages(), maxFlashPages(i + 1));
+  }
+  static constexpr uint16_t maxEEPROMSize(const uint8_t i = 0) {
+    return (i == DEVICE_COUNT) ? 0 : larger(DEVICES[i].eepromSize, maxEEPROMSize(i + 1));
+  }
+
+  static constexpr uint16_t MAX_FLASH_PAGE_SIZE = maxFlashPageSize();
+  static constexpr uint16_t MAX_FLASH_PAGES = maxFlashPages();
+  static constexpr uint16_t MAX_EEPROM_SIZE = maxEEPROMSize();
+  static constexpr uint16_t MAX_USER_SIG_SIZE = MAX_FLASH_PAGE_SIZE;
 }
 
 #endif
@@ -15,6 +15,16 @@ namespace Util {
     SERIAL_TIMEOUT,
     INVALID_LENGTH,
     INVALID_SECTION,
+    SHADOW_MISMATCH,
+    // The target's signature is not in TargetConfig::DEVICES.
+    UNKNOWN_DEVICE,
+    // Targets written together are not all the same device.
+    DEVICE_MISMATCH,
+    // Lock bits that are programmed can only be erased with the chip.
+    LOCKED,
+    // The host reset the link partway through the request, so the rest of
+    // its data never arrived.
+    ABORTED,
     UNKNOWN_ERROR,
   };
 
@@ -36,7 +46,21 @@ namespace Util {
     bool ok() const { return status == Status::OK; }
   };
 
+  class MaybeUint32 {
+  public:
+    Status status;
+    uint32_t data;
+    MaybeUint32(Status status_ = Status::UNKNOWN_ERROR, uint32_t data_ = 0)
+      : status(status_), data(data_) {}
+    bool ok() const { return status == Status::OK; }
+  };
+
   typedef uint8_t (*ByteProviderCallback)();
+  // Non-blocking variant of ByteProviderCallback. Returns false if no byte is
+  // available yet.
+  typedef bool (*ByteTryProviderCallback)(uint8_t * const data);
+  // Returns true once the bytes from a provider can no longer be trusted.
+  typedef bool (*AbortCallback)();
 }
 
 #endif
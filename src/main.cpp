@@ -1,8 +1,14 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "CRC.hpp"
+#include "Client.hpp"
+#include "Decompressor.hpp"
 #include "NVM.hpp"
+#include "PDI.hpp"
 #include "Platform.hpp"
+#include "Stats.hpp"
+#include "TargetConfig.hpp"
 #include "Util.hpp"
 
 namespace Request {
@@ -10,6 +16,23 @@ namespace Request {
   static constexpr uint8_t ERASE_CHIP = 0x01;
   static constexpr uint8_t WRITE_APP_FLASH = 0x02;
   static constexpr uint8_t WRITE_FUSE = 0x03;
+  static constexpr uint8_t VERIFY_CRC = 0x04;
+  static constexpr uint8_t READ_MEMORY = 0x05;
+  static constexpr uint8_t PAGE_DIGESTS = 0x06;
+  static constexpr uint8_t ERASE_WRITE_APP_FLASH = 0x07;
+  static constexpr uint8_t SET_BAUD = 0x08;
+  static constexpr uint8_t ATTACH = 0x09;
+  static constexpr uint8_t WRITE_EEPROM = 0x0B;
+  static constexpr uint8_t READ_EEPROM = 0x0C;
+  static constexpr uint8_t ERASE_EEPROM = 0x0D;
+  static constexpr uint8_t WRITE_FLASH = 0x0E;
+  static constexpr uint8_t WRITE_USER_SIG = 0x0F;
+  static constexpr uint8_t STATS = 0x10;
+  static constexpr uint8_t SELECT_TARGET = 0x11;
+  static constexpr uint8_t WRITE_FLASH_TARGETS = 0x12;
+  static constexpr uint8_t WRITE_FLASH_COMPRESSED = 0x13;
+  static constexpr uint8_t ERASE_SECTION = 0x14;
+  static constexpr uint8_t WRITE_FUSES = 0x15;
   static constexpr uint8_t SYNC = 0x59;
   static constexpr uint8_t END = 0xFF;
 }
@@ -18,52 +41,64 @@ namespace Response {
   static constexpr uint8_t OK = 0x00;
 
   static constexpr uint8_t INVALID_REQUEST = 0x01;
+  static constexpr uint8_t CRC_MISMATCH = 0x02;
+  static constexpr uint8_t INVALID_ARGUMENT = 0x03;
+  static constexpr uint8_t INVALID_STREAM = 0x04;
+
+  // Failures talking to the target, one for each Util::Status.
+  static constexpr uint8_t SERIAL_ERROR = 0x10;
+  static constexpr uint8_t SERIAL_TIMEOUT = 0x11;
+  static constexpr uint8_t INVALID_LENGTH = 0x12;
+  static constexpr uint8_t INVALID_SECTION = 0x13;
+  static constexpr uint8_t SHADOW_MISMATCH = 0x14;
+  static constexpr uint8_t UNKNOWN_DEVICE = 0x15;
+  static constexpr uint8_t DEVICE_MISMATCH = 0x16;
+  static constexpr uint8_t LOCKED = 0x17;
+  // Never reaches the host, which has reset the link.
+  static constexpr uint8_t ABORTED = 0x18;
 
   static constexpr uint8_t SYNC = 0xA6;
 
+  // Never sent; returned by handlers that send their own response code
+  // followed by response data.
+  static constexpr uint8_t ALREADY_SENT = 0xFD;
+
   static constexpr uint8_t INTERNAL_ERROR = 0xFE;
   static constexpr uint8_t UNKNOWN_ERROR = 0xFF;
 }
 
-static void send(const uint8_t data) {
-  while (!Platform::ClientSerial::txBufferEmpty()) {}
-  Platform::ClientSerial::writeData(data);
-}
-
-static uint8_t recv() {
-  while (!Platform::ClientSerial::rxComplete()) {}
-  const uint8_t data = Platform::ClientSerial::readData();
-  send(0xFF);
-  return data;
-}
-
-static uint16_t recv2() {
-  union {
-    uint8_t bytes[2];
-    uint16_t word;
-  } u;
-  for (uint8_t i = 0; i < 2; i++) {
-    u.bytes[i] = recv();
-  }
-  return u.word;
-}
-
-static uint32_t recv4() {
-  union {
-    uint8_t bytes[4];
-    uint32_t word;
-  } u;
-  for (uint8_t i = 0; i < 4; i++) {
-    u.bytes[i] = recv();
-  }
-  return u.word;
-}
-
 static uint8_t statusToResponse(const Util::Status status) {
   switch (status) {
     case Util::Status::OK: {
       return Response::OK;
     }
+    case Util::Status::SERIAL_ERROR: {
+      return Response::SERIAL_ERROR;
+    }
+    case Util::Status::SERIAL_TIMEOUT: {
+      return Response::SERIAL_TIMEOUT;
+    }
+    case Util::Status::INVALID_LENGTH: {
+      return Response::INVALID_LENGTH;
+    }
+    case Util::Status::INVALID_SECTION: {
+      return Response::INVALID_SECTION;
+    }
+    case Util::Status::SHADOW_MISMATCH: {
+      return Response::SHADOW_MISMATCH;
+    }
+    case Util::Status::UNKNOWN_DEVICE: {
+      return Response::UNKNOWN_DEVICE;
+    }
+    case Util::Status::DEVICE_MISMATCH: {
+      return Response::DEVICE_MISMATCH;
+    }
+    case Util::Status::LOCKED: {
+      return Response::LOCKED;
+    }
+    case Util::Status::ABORTED: {
+      return Response::ABORTED;
+    }
     default: {
       return Response::INTERNAL_ERROR;
     }
@@ -83,6 +118,382 @@ static void ensureNVMInactive() {
   }
 }
 
+// Detach from every target, leaving the first selected.
+static void endAll() {
+  for (uint8_t channel = NVM::channels(); channel-- > 0;) {
+    NVM::select(channel);
+    ensureNVMInactive();
+  }
+}
+
+// Throw away a request payload that will not be used, to keep in step with the
+// host.
+static void discard(const uint16_t len) {
+  for (uint16_t i = 0; i < len; i++) {
+    Client::recv();
+  }
+}
+
+// Response: code, number of all-0xFF pages that were not programmed (2 bytes,
+// as a request can span 256 pages), address of the page that failed (4 bytes,
+// 0xFFFFFFFF if none did). Pages before it have been written, but any after it
+// have not.
+static uint8_t writeFlash(const NVM::Flash::Section section, const uint32_t addr, const uint16_t len, const bool preErase) {
+  const uint16_t skippedBefore = NVM::Flash::skippedPages();
+  uint8_t failed;
+  uint32_t failedAddr;
+  const Util::Status status = NVM::Flash::writeTargets(
+    1 << NVM::selected(),
+    addr,
+    Client::recv,
+    Client::tryRecv,
+    Client::aborted,
+    len,
+    preErase,
+    section,
+    &failed,
+    &failedAddr
+  );
+  Client::send(statusToResponse(status));
+  Client::send2(NVM::Flash::skippedPages() - skippedBefore);
+  Client::send4(failedAddr);
+  return Response::ALREADY_SENT;
+}
+
+// Attach to each of `targets` and write the same data to all of them.
+static Util::Status writeTargets(const NVM::Flash::Section section, const uint8_t targets, const uint32_t addr, const uint16_t len, const bool preErase, const Util::ByteProviderCallback callback, const Util::ByteTryProviderCallback tryCallback, uint8_t * const failed, uint32_t * const failedAddr) {
+  const uint8_t originalChannel = NVM::selected();
+  for (uint8_t channel = 0; channel < NVM::channels(); channel++) {
+    if (targets & (1 << channel)) {
+      NVM::select(channel);
+      ensureNVMActive();
+    }
+  }
+  NVM::select(originalChannel);
+
+  return NVM::Flash::writeTargets(targets, addr, callback, tryCallback, Client::aborted, len, preErase, section, failed, failedAddr);
+}
+
+// Response: code, mask of the targets that failed, number of all-0xFF pages
+// that were not programmed and address of the first page that failed (both as
+// for writeFlash). The code is OK unless every target failed.
+static uint8_t writeFlashTargets(const NVM::Flash::Section section, const uint8_t targets, const uint32_t addr, const uint16_t len, const bool preErase) {
+  const uint16_t skippedBefore = NVM::Flash::skippedPages();
+  uint8_t failed;
+  uint32_t failedAddr;
+  const Util::Status status = writeTargets(section, targets, addr, len, preErase, Client::recv, Client::tryRecv, &failed, &failedAddr);
+  Client::send((failed == targets) ? statusToResponse(status) : Response::OK);
+  Client::send(failed);
+  Client::send2(NVM::Flash::skippedPages() - skippedBefore);
+  Client::send4(failedAddr);
+  return Response::ALREADY_SENT;
+}
+
+// As writeFlashTargets(), for `len` bytes decoded from `streamLen` bytes of
+// compressed stream. The code is INVALID_STREAM if the stream did not decode
+// to exactly `len` bytes, although what it gave has been written.
+static uint8_t writeFlashCompressed(const NVM::Flash::Section section, const uint8_t targets, const uint32_t addr, const uint16_t len, const uint16_t streamLen, const bool preErase) {
+  const uint16_t skippedBefore = NVM::Flash::skippedPages();
+  uint8_t failed;
+  uint32_t failedAddr;
+  Decompressor::begin(Client::recv, Client::tryRecv, streamLen);
+  const Util::Status status = writeTargets(section, targets, addr, len, preErase, Decompressor::recv, Decompressor::tryRecv, &failed, &failedAddr);
+  const bool streamValid = Decompressor::end();
+  if (failed == targets) {
+    Client::send(statusToResponse(status));
+  } else {
+    Client::send(streamValid ? Response::OK : Response::INVALID_STREAM);
+  }
+  Client::send(failed);
+  Client::send2(NVM::Flash::skippedPages() - skippedBefore);
+  Client::send4(failedAddr);
+  return Response::ALREADY_SENT;
+}
+
+// Response: code, target CRC (4 bytes), expected CRC (4 bytes), 1 if the
+// expected CRC is known.
+static uint8_t verifyCrc(const NVM::Flash::Section section) {
+  const Util::MaybeUint32 actual = NVM::Flash::crc(section);
+  if (!actual.ok()) {
+    return statusToResponse(actual.status);
+  }
+  const Util::MaybeUint32 expected = NVM::Flash::expectedCrc(section);
+  const bool mismatch = expected.ok() && expected.data != actual.data;
+  if (!expected.ok() || mismatch) {
+    // Unless the CRC is known to be right, an erase we counted on may not
+    // have happened.
+    NVM::Flash::forgetErased(section);
+  }
+  Client::send(mismatch ? Response::CRC_MISMATCH : Response::OK);
+  Client::send4(actual.data);
+  Client::send4(expected.data);
+  Client::send(expected.ok());
+  return Response::ALREADY_SENT;
+}
+
+// READ_MEMORY response data is a sequence of records, each starting with one
+// of these tags:
+//   LITERAL len(2) bytes[len]
+//   ERASED len(4)                 `len` bytes of 0xFF
+//   END response(1)               response code for the read as a whole
+namespace ReadRecord {
+  static constexpr uint8_t LITERAL = 0x00;
+  static constexpr uint8_t ERASED = 0x01;
+  static constexpr uint8_t END = 0x02;
+
+  // Shorter runs of 0xFF are sent as literals; a record costs 3-5 bytes.
+  static constexpr uint16_t MIN_ERASED_RUN = 8;
+}
+
+static uint8_t readBuffer[TargetConfig::MAX_FLASH_PAGE_SIZE];
+
+static uint16_t erasedRun(const uint16_t start, const uint16_t len) {
+  uint16_t i = start;
+  while (i < len && readBuffer[i] == 0xFF) {
+    i++;
+  }
+  return i - start;
+}
+
+// Encode readBuffer[0..len), accumulating erased runs in `pendingErased` so
+// that they can span pages.
+static void encodeReadBuffer(const uint16_t len, uint32_t * const pendingErased) {
+  uint16_t i = 0;
+  while (i < len) {
+    const uint16_t run = erasedRun(i, len);
+    if (run >= ReadRecord::MIN_ERASED_RUN) {
+      *pendingErased += run;
+      i += run;
+      continue;
+    }
+
+    // Extend the literal up to the next long erased run.
+    uint16_t end = i;
+    while (end < len) {
+      const uint16_t endRun = erasedRun(end, len);
+      if (endRun >= ReadRecord::MIN_ERASED_RUN) { break; }
+      end += endRun ? endRun : 1;
+    }
+
+    if (*pendingErased) {
+      Client::send(ReadRecord::ERASED);
+      Client::send4(*pendingErased);
+      *pendingErased = 0;
+    }
+    Client::send(ReadRecord::LITERAL);
+    Client::send2(end - i);
+    for (; i < end; i++) {
+      Client::send(readBuffer[i]);
+    }
+  }
+}
+
+static uint8_t readMemory(const uint32_t addr, const uint32_t len) {
+  Client::send(Response::OK);
+
+  uint32_t currAddr = addr;
+  uint32_t remaining = len;
+  uint32_t pendingErased = 0;
+  uint8_t response = Response::OK;
+  while (remaining) {
+    const uint16_t chunkLen = (remaining < sizeof(readBuffer)) ? remaining : sizeof(readBuffer);
+    const Util::Status status = NVM::read(currAddr, readBuffer, chunkLen);
+    if (status != Util::Status::OK) {
+      response = statusToResponse(status);
+      break;
+    }
+    encodeReadBuffer(chunkLen, &pendingErased);
+    currAddr += chunkLen;
+    remaining -= chunkLen;
+  }
+
+  if (pendingErased) {
+    Client::send(ReadRecord::ERASED);
+    Client::send4(pendingErased);
+  }
+  Client::send(ReadRecord::END);
+  Client::send(response);
+  return Response::ALREADY_SENT;
+}
+
+// Response: OK, a CRC16 digest of each page (2 bytes each), response code,
+// address of the page that could not be read (4 bytes, 0xFFFFFFFF if none).
+// If reading fails, the remaining digests are sent as 0. If the target cannot
+// be identified, they all are and the address is 0.
+static uint8_t pageDigests(const NVM::Flash::Section section, const uint16_t firstPage, const uint16_t count) {
+  const Util::Status identifyStatus = NVM::identify();
+  const TargetConfig::Device & device = NVM::device();
+  Client::send(Response::OK);
+
+  uint8_t response = statusToResponse(identifyStatus);
+  uint32_t failedAddr = (identifyStatus == Util::Status::OK) ? NVM::Flash::NO_FAILURE : 0;
+  for (uint16_t i = 0; i < count; i++) {
+    uint16_t crc = 0;
+    if (response == Response::OK) {
+      const uint32_t flashAddr = ((uint32_t) (firstPage + i)) << device.flashPageShift;
+      const Util::Status status = NVM::Flash::read(flashAddr, readBuffer, device.flashPageSize(), section);
+      if (status == Util::Status::OK) {
+        crc = CRC::CRC16_INIT;
+        for (uint16_t j = 0; j < device.flashPageSize(); j++) {
+          crc = CRC::update16(crc, readBuffer[j]);
+        }
+      } else {
+        response = statusToResponse(status);
+        failedAddr = flashAddr;
+      }
+    }
+    Client::send2(crc);
+  }
+
+  Client::send(response);
+  Client::send4(failedAddr);
+  return Response::ALREADY_SENT;
+}
+
+// Identify the target and check that [addr, addr + len) is within its
+// EEPROM, so that a bad request fails before anything is sent.
+static uint8_t checkEEPROMRange(const uint16_t addr, const uint16_t len) {
+  const Util::Status status = NVM::identify();
+  if (status != Util::Status::OK) {
+    return statusToResponse(status);
+  }
+  const uint16_t size = NVM::device().eepromSize;
+  return (addr <= size && len <= size - addr) ? Response::OK : Response::INVALID_ARGUMENT;
+}
+
+// Response: code, number of pages that already held the data and were not
+// written.
+static uint8_t writeEEPROM(const uint16_t addr, const uint16_t len) {
+  const uint8_t rangeResponse = checkEEPROMRange(addr, len);
+  if (rangeResponse != Response::OK) {
+    discard(len);
+    return rangeResponse;
+  }
+  const uint16_t unchangedBefore = NVM::EEPROM::unchangedPages();
+  const Util::Status status = NVM::EEPROM::write(addr, Client::recv, Client::aborted, len);
+  Client::send(statusToResponse(status));
+  Client::send(NVM::EEPROM::unchangedPages() - unchangedBefore);
+  return Response::ALREADY_SENT;
+}
+
+// Response: OK, `len` bytes, response code. If reading fails, the remaining
+// bytes are sent as 0xFF.
+static uint8_t readEEPROM(const uint16_t addr, const uint16_t len) {
+  const uint8_t rangeResponse = checkEEPROMRange(addr, len);
+  if (rangeResponse != Response::OK) {
+    return rangeResponse;
+  }
+  Client::send(Response::OK);
+
+  uint16_t currAddr = addr;
+  uint16_t remaining = len;
+  uint8_t response = Response::OK;
+  while (remaining) {
+    const uint16_t chunkLen = Util::min(remaining, (uint16_t) sizeof(readBuffer));
+    if (response == Response::OK) {
+      const Util::Status status = NVM::EEPROM::read(currAddr, readBuffer, chunkLen);
+      if (status != Util::Status::OK) {
+        response = statusToResponse(status);
+      }
+    }
+    for (uint16_t i = 0; i < chunkLen; i++) {
+      Client::send((response == Response::OK) ? readBuffer[i] : 0xFF);
+    }
+    currAddr += chunkLen;
+    remaining -= chunkLen;
+  }
+
+  Client::send(response);
+  return Response::ALREADY_SENT;
+}
+
+// Response: code, PDI clock rate (Hz), guard time (clock cycles), signature
+// (3 bytes), flash page size, application and boot section pages, EEPROM size
+// (2 bytes each). The sizes are 0 for a device not in TargetConfig::DEVICES,
+// and the signature too if it could not be read.
+static uint8_t attach() {
+  ensureNVMActive();
+  NVM::identify();
+  const TargetConfig::Device & device = NVM::device();
+  Client::send(Response::OK);
+  Client::send4(PDI::clock());
+  Client::send(128 >> (uint8_t) PDI::guardTime());
+  for (uint8_t i = 0; i < TargetConfig::DEVID_LEN; i++) {
+    Client::send(NVM::signature()[i]);
+  }
+  Client::send2(device.id ? device.flashPageSize() : 0);
+  Client::send2(device.appPages);
+  Client::send2(device.bootPages);
+  Client::send2(device.eepromSize);
+  return Response::ALREADY_SENT;
+}
+
+// Request: mask of the bytes given (see NVM::Fuse::update), then each value in
+// mask bit order.
+// Response: code, mask of the bytes written, then what each byte held before
+// (0xFF for any that could not be read).
+static uint8_t writeFuses() {
+  static constexpr uint8_t MAX_BYTES = TargetConfig::FUSE_COUNT + 1;
+  static constexpr uint8_t VALID_MASK = ((1 << TargetConfig::FUSE_COUNT) - 1) | NVM::Fuse::LOCK_MASK;
+
+  const uint8_t mask = Client::recv();
+  uint8_t count = 0;
+  for (uint8_t bits = mask; bits; bits &= bits - 1) {
+    count++;
+  }
+  if (mask & ~VALID_MASK) {
+    discard(count);
+    return Response::INVALID_ARGUMENT;
+  }
+
+  uint8_t values[MAX_BYTES];
+  uint8_t previous[MAX_BYTES];
+  for (uint8_t i = 0; i < count; i++) {
+    values[i] = Client::recv();
+    previous[i] = 0xFF;
+  }
+  if (Client::aborted()) {
+    return Response::ABORTED;
+  }
+
+  ensureNVMActive();
+  uint8_t written;
+  const Util::Status status = NVM::Fuse::update(mask, values, previous, &written);
+  Client::send(statusToResponse(status));
+  Client::send(written);
+  for (uint8_t i = 0; i < count; i++) {
+    Client::send(previous[i]);
+  }
+  return Response::ALREADY_SENT;
+}
+
+// Response: OK, timer ticks per second, number of counters, each counter (4
+// bytes), number of phases, then for each phase the number of completions,
+// total ticks and longest ticks (4 bytes each). The order is that of
+// Stats::Counter and Stats::Phase.
+static uint8_t stats(const bool reset) {
+  static constexpr uint8_t COUNTERS = (uint8_t) Stats::Counter::COUNT;
+  static constexpr uint8_t PHASES = (uint8_t) Stats::Phase::COUNT;
+
+  Client::send(Response::OK);
+  Client::send4(Platform::Timer::TICK_HZ);
+  Client::send(COUNTERS);
+  for (uint8_t i = 0; i < COUNTERS; i++) {
+    Client::send4(Stats::counter((Stats::Counter) i));
+  }
+  Client::send(PHASES);
+  for (uint8_t i = 0; i < PHASES; i++) {
+    const Stats::Phase phase = (Stats::Phase) i;
+    Client::send4(Stats::completions(phase));
+    Client::send4(Stats::totalTicks(phase));
+    Client::send4(Stats::maxTicks(phase));
+  }
+  if (reset) {
+    Stats::reset();
+  }
+  return Response::ALREADY_SENT;
+}
+
 static uint8_t dispatch(const uint8_t request) {
   switch (request) {
     case Request::NOP: {
@@ -93,29 +504,193 @@ static uint8_t dispatch(const uint8_t request) {
       return statusToResponse(NVM::eraseChip());
     }
     case Request::WRITE_APP_FLASH: {
-      const uint32_t addr = recv4();
-      const uint16_t len = recv2();
+      const uint32_t addr = Client::recv4();
+      const uint16_t len = Client::recv2();
+      ensureNVMActive();
+      return writeFlash(NVM::Flash::Section::APP, addr, len, false);
+    }
+    case Request::ERASE_WRITE_APP_FLASH: {
+      const uint32_t addr = Client::recv4();
+      const uint16_t len = Client::recv2();
       ensureNVMActive();
-      return statusToResponse(NVM::Flash::write(
-        addr,
-        recv,
-        len,
-        false,
-        NVM::Flash::Section::APP
-      ));
+      return writeFlash(NVM::Flash::Section::APP, addr, len, true);
     }
     case Request::WRITE_FUSE: {
-      const uint8_t addr = recv();
-      const uint8_t data = recv();
+      const uint8_t addr = Client::recv();
+      const uint8_t data = Client::recv();
+      if (Client::aborted()) {
+        return Response::ABORTED;
+      }
       ensureNVMActive();
       return statusToResponse(NVM::Fuse::write(addr, data));
     }
+    case Request::VERIFY_CRC: {
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      ensureNVMActive();
+      return verifyCrc(section);
+    }
+    case Request::READ_MEMORY: {
+      const uint32_t addr = Client::recv4();
+      const uint32_t len = Client::recv4();
+      ensureNVMActive();
+      return readMemory(addr, len);
+    }
+    case Request::PAGE_DIGESTS: {
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      const uint16_t firstPage = Client::recv2();
+      const uint16_t count = Client::recv2();
+      ensureNVMActive();
+      return pageDigests(section, firstPage, count);
+    }
+    case Request::SET_BAUD: {
+      // On success the OK response is sent at the old rate, then the host
+      // must resynchronise at the new one.
+      const uint32_t baud = Client::recv4();
+      if (!Platform::ClientSerial::baudRateSupported(baud)) {
+        return Response::INVALID_ARGUMENT;
+      }
+      Client::send(Response::OK);
+      Client::setBaudRate(baud);
+      return Response::ALREADY_SENT;
+    }
+    case Request::ATTACH: {
+      return attach();
+    }
+    case Request::STATS: {
+      static constexpr uint8_t RESET = 0x01;
+
+      const uint8_t flags = Client::recv();
+      return stats(flags & RESET);
+    }
+    case Request::WRITE_EEPROM: {
+      const uint16_t addr = Client::recv2();
+      const uint16_t len = Client::recv2();
+      ensureNVMActive();
+      return writeEEPROM(addr, len);
+    }
+    case Request::READ_EEPROM: {
+      const uint16_t addr = Client::recv2();
+      const uint16_t len = Client::recv2();
+      ensureNVMActive();
+      return readEEPROM(addr, len);
+    }
+    case Request::ERASE_EEPROM: {
+      const uint16_t addr = Client::recv2();
+      const uint16_t len = Client::recv2();
+      if (Client::aborted()) {
+        return Response::ABORTED;
+      }
+      ensureNVMActive();
+      const uint8_t rangeResponse = checkEEPROMRange(addr, len);
+      if (rangeResponse != Response::OK) {
+        return rangeResponse;
+      }
+      return statusToResponse(NVM::EEPROM::erase(addr, len));
+    }
+    case Request::WRITE_FLASH: {
+      static constexpr uint8_t PRE_ERASE = 0x01;
+
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      const uint8_t flags = Client::recv();
+      const uint32_t addr = Client::recv4();
+      const uint16_t len = Client::recv2();
+      if (section != NVM::Flash::Section::APP && section != NVM::Flash::Section::BOOT) {
+        discard(len);
+        return Response::INVALID_ARGUMENT;
+      }
+      ensureNVMActive();
+      return writeFlash(section, addr, len, flags & PRE_ERASE);
+    }
+    case Request::WRITE_USER_SIG: {
+      const uint16_t len = Client::recv2();
+      ensureNVMActive();
+      const Util::Status status = NVM::identify();
+      if (status != Util::Status::OK) {
+        discard(len);
+        return statusToResponse(status);
+      }
+      if (len > NVM::device().userSigSize()) {
+        discard(len);
+        return Response::INVALID_ARGUMENT;
+      }
+      // The row is erased first, so all of it must have arrived.
+      for (uint16_t i = 0; i < len; i++) {
+        readBuffer[i] = Client::recv();
+      }
+      if (Client::aborted()) {
+        return Response::ABORTED;
+      }
+      return statusToResponse(NVM::UserSig::write(readBuffer, len));
+    }
+    case Request::SELECT_TARGET: {
+      // Response: code, number of targets. Later requests go to the selected
+      // target; any others stay attached.
+      const uint8_t target = Client::recv();
+      const bool valid = target < NVM::channels();
+      if (valid) {
+        NVM::select(target);
+      }
+      Client::send(valid ? Response::OK : Response::INVALID_ARGUMENT);
+      Client::send(NVM::channels());
+      return Response::ALREADY_SENT;
+    }
+    case Request::WRITE_FLASH_TARGETS: {
+      static constexpr uint8_t PRE_ERASE = 0x01;
+
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      const uint8_t flags = Client::recv();
+      const uint8_t targets = Client::recv();
+      const uint32_t addr = Client::recv4();
+      const uint16_t len = Client::recv2();
+      const uint8_t allTargets = (1 << NVM::channels()) - 1;
+      if ((section != NVM::Flash::Section::APP && section != NVM::Flash::Section::BOOT) ||
+          targets == 0 || (targets & ~allTargets)) {
+        discard(len);
+        return Response::INVALID_ARGUMENT;
+      }
+      return writeFlashTargets(section, targets, addr, len, flags & PRE_ERASE);
+    }
+    case Request::WRITE_FLASH_COMPRESSED: {
+      // Like WRITE_FLASH_TARGETS, but with a compressed payload (see
+      // Decompressor.hpp) that decodes to `len` bytes. A target mask of 0
+      // means the selected target.
+      static constexpr uint8_t PRE_ERASE = 0x01;
+
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      const uint8_t flags = Client::recv();
+      const uint8_t mask = Client::recv();
+      const uint32_t addr = Client::recv4();
+      const uint16_t len = Client::recv2();
+      const uint16_t streamLen = Client::recv2();
+      const uint8_t allTargets = (1 << NVM::channels()) - 1;
+      const uint8_t targets = mask ? mask : (1 << NVM::selected());
+      if ((section != NVM::Flash::Section::APP && section != NVM::Flash::Section::BOOT) ||
+          (targets & ~allTargets)) {
+        discard(streamLen);
+        return Response::INVALID_ARGUMENT;
+      }
+      return writeFlashCompressed(section, targets, addr, len, streamLen, flags & PRE_ERASE);
+    }
+    case Request::ERASE_SECTION: {
+      // Left out if the whole section is known to be erased already.
+      const NVM::Flash::Section section = (NVM::Flash::Section) Client::recv();
+      if (Client::aborted()) {
+        return Response::ABORTED;
+      }
+      ensureNVMActive();
+      return statusToResponse(NVM::Flash::eraseSection(0, section));
+    }
+    case Request::WRITE_FUSES: {
+      return writeFuses();
+    }
     case Request::SYNC: {
       return Response::SYNC;
     }
     case Request::END: {
-      ensureNVMInactive();
-      return Response::OK;
+      endAll();
+      Client::send(Response::OK);
+      Client::resetBaudRate();
+      return Response::ALREADY_SENT;
     }
     default: {
       return Response::INVALID_REQUEST;
@@ -125,12 +700,19 @@ static uint8_t dispatch(const uint8_t request) {
 }
 
 int main() {
-  Platform::ClientSerial::init();
+  Platform::Timer::init();
+  Client::init();
   NVM::init();
 
   while (1) {
-    const uint8_t request = recv();
-    const uint8_t response = dispatch(request);
-    send(response);
+    // A reset while waiting for a request gives no request at all.
+    const uint8_t request = Client::recv();
+    if (!Client::aborted()) {
+      const uint8_t response = dispatch(request);
+      if (response != Response::ALREADY_SENT) {
+        Client::send(response);
+      }
+    }
+    Client::endRequest();
   }
 }
\ No newline at end of file